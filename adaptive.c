@@ -0,0 +1,170 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Adaptive tap timeout of each seat, following a high quantile of how long its
+// dual-role keys are held when pressed alone, optionally persisted in a state
+// file.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Estimates of the seats in the state file, once mapped, which are only
+// written by the event loop, and estimate published in the counters: that of
+// the seat learned from last, if any.
+AdaptiveFile *adaptive_file = NULL;
+const AdaptiveState no_adaptive;
+const AdaptiveState *reported_adaptive = &no_adaptive;
+
+// Return the current tap timeout of the given estimate, in microseconds: the
+// estimate clamped to the configured bounds once it has learned from a press,
+// and the configured timeout otherwise.
+long tapTimeoutUs(const AdaptiveState *adaptive) {
+  if (config->adaptive_max_ms == 0 || adaptive->samples == 0) {
+    return config->timeout_ms * 1000L;
+  }
+  long min_us = config->adaptive_min_ms * 1000L;
+  long max_us = config->adaptive_max_ms * 1000L;
+  if (adaptive->estimate_us < min_us) {
+    return min_us;
+  }
+  return adaptive->estimate_us > max_us ? max_us : adaptive->estimate_us;
+}
+
+// Publish the current tap timeout in the counters.
+void reportTimeout(void) {
+  stats->timeout_us = tapTimeoutUs(reported_adaptive);
+}
+
+// Learn from a dual-role key held for the given duration, in microseconds,
+// without any other key being pressed meanwhile, in the given estimate. It is
+// moved by a fixed step towards the quantile: up by most of it for longer
+// presses, and down by the rest otherwise, so that it settles where the given
+// share of the presses are shorter, and a single long press cannot throw it
+// off.
+void adaptTimeout(AdaptiveState *adaptive, long duration_us) {
+  if (config->adaptive_max_ms == 0) {
+    return;
+  }
+  if (adaptive->samples == 0) {
+    adaptive->estimate_us = config->timeout_ms * 1000L;
+  }
+  long up_us = ADAPTIVE_STEP_US * ADAPTIVE_QUANTILE / 100;
+  if (duration_us > adaptive->estimate_us) {
+    adaptive->estimate_us += up_us;
+  } else {
+    adaptive->estimate_us -= ADAPTIVE_STEP_US - up_us;
+  }
+  // Don't drift out of the bounds, so that moving back in never takes long.
+  long min_us = config->adaptive_min_ms * 1000L;
+  long max_us = config->adaptive_max_ms * 1000L;
+  if (adaptive->estimate_us < min_us) {
+    adaptive->estimate_us = min_us;
+  } else if (adaptive->estimate_us > max_us) {
+    adaptive->estimate_us = max_us;
+  }
+  adaptive->samples++;
+  reported_adaptive = adaptive;
+  reportTimeout();
+}
+
+// Map the state file at the given path, creating it if needed, so that the
+// estimates of the seats added afterwards survive restarts without ever being
+// written explicitly: the kernel writes the page back. The estimates already in
+// the file are kept, otherwise they start over. Return 0 on success, -1 on
+// error.
+int mapAdaptiveState(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size != sizeof(AdaptiveFile) &&
+       ftruncate(fd, sizeof(AdaptiveFile)) < 0)) {
+    close(fd);
+    return -1;
+  }
+  // Fault the pages in now, so that learning never does.
+  AdaptiveFile *shared =
+      mmap(NULL, sizeof(AdaptiveFile), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (shared == MAP_FAILED) {
+    return -1;
+  }
+  if (memcmp(shared->magic, ADAPTIVE_MAGIC, sizeof(shared->magic)) != 0 ||
+      shared->version != ADAPTIVE_VERSION) {
+    memset(shared, 0, sizeof(AdaptiveFile));
+    memcpy(shared->magic, ADAPTIVE_MAGIC, sizeof(shared->magic));
+    shared->version = ADAPTIVE_VERSION;
+  }
+  adaptive_file = shared;
+  return 0;
+}
+
+// Point the given seat at its estimate in the state file, taking a free entry
+// the first time, or at an estimate of its own if there is no state file or it
+// is full.
+void bindAdaptiveState(Seat *seat) {
+  seat->adaptive = &seat->local_adaptive;
+  if (adaptive_file == NULL) {
+    return;
+  }
+  AdaptiveState *free_entry = NULL;
+  for (size_t i = 0; i < MAX_ADAPTIVE_SEATS; i++) {
+    AdaptiveState *entry = &adaptive_file->seats[i];
+    if (strncmp(entry->seat, seat->name, sizeof(entry->seat)) == 0) {
+      seat->adaptive = entry;
+      return;
+    }
+    if (entry->seat[0] == '\0' && free_entry == NULL) {
+      free_entry = entry;
+    }
+  }
+  if (free_entry == NULL) {
+    warn("No room left in the adaptive timeout state file");
+    return;
+  }
+  memset(free_entry, 0, sizeof(*free_entry));
+  strcpy(free_entry->seat, seat->name);
+  seat->adaptive = free_entry;
+}
+
+// Parse the bounds of the adaptive timeout, in the MIN_MS:MAX_MS format, into
+// the given configuration. Return 0 on success, -1 on error.
+int parseAdaptiveBounds(Config *c, const char *bounds) {
+  char *end;
+  long min_ms = strtol(bounds, &end, 10);
+  if (end == bounds || *end != ':') {
+    return -1;
+  }
+  const char *max = end + 1;
+  long max_ms = strtol(max, &end, 10);
+  if (end == max || *end != '\0' || min_ms <= 0 || min_ms > max_ms ||
+      max_ms > 60000) {
+    return -1;
+  }
+  c->adaptive_min_ms = min_ms;
+  c->adaptive_max_ms = max_ms;
+  return 0;
+}
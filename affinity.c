@@ -0,0 +1,257 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// CPU affinity of the event loop, either given as a list of CPUs or following
+// the interrupts of the keyboards, so that events are handled on a warm cache.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <libudev.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wlcape.h"
+
+// CPUs to pin the event loop to, or none, and whether the CPUs servicing the
+// interrupts of the keyboards are added to them.
+cpu_set_t affinity;
+int follow_irqs = 0;
+
+// Add the CPUs of the given list, in the N[-M][,N[-M]...] format of the
+// kernel, to the given set. Return 0 on success, -1 on error.
+int parseCpuList(const char *list, cpu_set_t *set) {
+  const char *p = list;
+  char *end;
+  for (;;) {
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0) {
+      return -1;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return -1;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    if (*end != ',') {
+      break;
+    }
+    p = end + 1;
+  }
+  // The kernel terminates its lists with a newline.
+  return *end == '\0' || strcmp(end, "\n") == 0 ? 0 : -1;
+}
+
+// Add the CPUs servicing the given interrupt to the given set. Return 0 on
+// success, -1 on error.
+int addIrqCpus(int irq, cpu_set_t *set) {
+  // The effective affinity is the CPU actually picked by the interrupt
+  // controller among those allowed, on the kernels reporting it.
+  static const char *const files[] = {"effective_affinity_list",
+                                      "smp_affinity_list"};
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    char path[64];
+    char list[256];
+    snprintf(path, sizeof(path), "/proc/irq/%d/%s", irq, files[i]);
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+      continue;
+    }
+    char *line = fgets(list, sizeof(list), file);
+    fclose(file);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (line != NULL && parseCpuList(line, &cpus) == 0 && CPU_COUNT(&cpus)) {
+      CPU_OR(set, set, &cpus);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Add the CPUs servicing the interrupts of the given device to the given set,
+// from its MSI vectors or its legacy interrupt line. Return the number of
+// interrupts found.
+int addDeviceIrqCpus(struct udev_device *device, cpu_set_t *set) {
+  int n_irqs = 0;
+  char path[512];
+  snprintf(path, sizeof(path), "%s/msi_irqs",
+           udev_device_get_syspath(device));
+  DIR *dir = opendir(path);
+  if (dir != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.' &&
+          addIrqCpus(atoi(entry->d_name), set) == 0) {
+        n_irqs++;
+      }
+    }
+    closedir(dir);
+  }
+  const char *irq = udev_device_get_sysattr_value(device, "irq");
+  if (n_irqs == 0 && irq != NULL && atoi(irq) > 0 &&
+      addIrqCpus(atoi(irq), set) == 0) {
+    n_irqs++;
+  }
+  return n_irqs;
+}
+
+// Add the CPUs servicing the interrupts named after the given driver in
+// /proc/interrupts to the given set, for the devices that don't expose their
+// interrupts in sysfs, like the i8042 controller of PS/2 keyboards. Return the
+// number of interrupts found.
+int addDriverIrqCpus(const char *driver, cpu_set_t *set) {
+  FILE *file = fopen("/proc/interrupts", "re");
+  if (file == NULL) {
+    return 0;
+  }
+  int n_irqs = 0;
+  size_t length = strlen(driver);
+  char line[4096];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    // The handlers sharing the interrupt end the line, separated by commas.
+    char *end;
+    long irq = strtol(line, &end, 10);
+    if (end == line || *end != ':') {
+      continue;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    for (char *name = strstr(end, driver); name != NULL;
+         name = strstr(name + 1, driver)) {
+      if ((name[-1] == ' ' || name[-1] == ',') &&
+          (name[length] == '\0' || name[length] == ',') &&
+          addIrqCpus(irq, set) == 0) {
+        n_irqs++;
+        break;
+      }
+    }
+  }
+  fclose(file);
+  return n_irqs;
+}
+
+// Add the CPUs servicing the interrupts of the given input device to the given
+// set, which are those of the closest ancestor with any, like the host
+// controller of a USB keyboard. Return 0 if any were found, -1 otherwise.
+int addKeyboardIrqCpus(struct udev_device *device, cpu_set_t *set) {
+  for (struct udev_device *d = device; d != NULL;
+       d = udev_device_get_parent(d)) {
+    if (addDeviceIrqCpus(d, set) > 0) {
+      return 0;
+    }
+  }
+  for (struct udev_device *d = device; d != NULL;
+       d = udev_device_get_parent(d)) {
+    const char *driver = udev_device_get_driver(d);
+    if (driver != NULL && addDriverIrqCpus(driver, set) > 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Add the CPUs servicing the interrupts of the keyboards to the given set:
+// those monitored already, or else those the helper process is going to pass.
+// Return the number of keyboards whose interrupts were found.
+int addKeyboardsIrqCpus(cpu_set_t *set) {
+  struct udev *udev = udev_new();
+  if (udev == NULL) {
+    return 0;
+  }
+  int n_found = 0;
+  if (n_keyboards > 0) {
+    for (size_t i = 0; i < n_keyboards; i++) {
+      struct udev_device *device =
+          udev_device_new_from_devnum(udev, 'c', keyboards[i]->devnum);
+      if (device != NULL) {
+        n_found += addKeyboardIrqCpus(device, set) == 0;
+        udev_device_unref(device);
+      }
+    }
+  } else {
+    struct udev_enumerate *enumerate = enumerateKeyboards(udev);
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+      struct udev_device *device = udev_device_new_from_syspath(
+          udev, udev_list_entry_get_name(entry));
+      if (device != NULL) {
+        if (isMonitoredKeyboard(device)) {
+          n_found += addKeyboardIrqCpus(device, set) == 0;
+        }
+        udev_device_unref(device);
+      }
+    }
+    udev_enumerate_unref(enumerate);
+  }
+  udev_unref(udev);
+  return n_found;
+}
+
+// Set the CPUs to pin the event loop to, given as a list of CPUs, or as "irq"
+// for those servicing the interrupts of the keyboards. Return 0 on success, -1
+// on error.
+int parseAffinity(const char *spec) {
+  CPU_ZERO(&affinity);
+  follow_irqs = strcmp(spec, "irq") == 0;
+  if (follow_irqs) {
+    return 0;
+  }
+  if (parseCpuList(spec, &affinity) < 0 || CPU_COUNT(&affinity) == 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Pin the event loop to the CPUs set with parseAffinity(), if any, among those
+// it is allowed to run on. Call once the keyboards are added, and before
+// locking memory, so that the pages faulted in then come from the NUMA node of
+// these CPUs. Fails on error.
+void pinEventLoop(void) {
+  cpu_set_t set = affinity;
+  if (follow_irqs && addKeyboardsIrqCpus(&set) == 0) {
+    // Hotplugged keyboards are not followed, but the loop can still run.
+    warn("No keyboard interrupt found, not pinning the event loop");
+    return;
+  }
+  if (CPU_COUNT(&set) == 0) {
+    return;
+  }
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    die("Error getting CPU affinity");
+  }
+  CPU_AND(&set, &set, &allowed);
+  if (CPU_COUNT(&set) == 0) {
+    if (follow_irqs) {
+      warn("Keyboard interrupts serviced out of the allowed CPUs");
+      return;
+    }
+    die("None of the CPUs given is allowed");
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+    die("Error setting CPU affinity");
+  }
+}
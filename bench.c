@@ -0,0 +1,649 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark replaying recorded or synthetic keyboard events through the same
+// handling code as the daemon, reporting its throughput and latency.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Default number of events generated for each synthetic workload.
+#define DEFAULT_WORKLOAD_EVENTS 1000000
+
+// Default number of minutes to watch the wakeups of a running daemon for.
+#define DEFAULT_WATCH_MINUTES 10
+
+// Number of keyboards typing at the same time in the multi-keyboard workload.
+#define MULTI_KEYBOARDS 4
+
+// A stream of events to replay.
+typedef struct {
+  const char *name;
+  TraceRecord *records;
+  size_t n_records;
+  size_t max_records;
+} Workload;
+
+// State of the pseudo-random number generator, so that synthetic workloads
+// are the same on every run.
+uint32_t random_state = 1;
+
+// Return a pseudo-random number in the [min, max] range.
+uint32_t randomBetween(uint32_t min, uint32_t max) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return min + random_state % (max - min + 1);
+}
+
+// Return the current time of the monotonic clock, in nanoseconds.
+uint64_t nowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Append an event to a workload. Fails on error.
+void appendEvent(Workload *w, int device, uint64_t time_us, int type,
+                 int code, int value) {
+  if (w->n_records == w->max_records) {
+    w->max_records = w->max_records ? w->max_records * 2 : 1024;
+    w->records = realloc(w->records, w->max_records * sizeof(TraceRecord));
+    if (w->records == NULL) {
+      die("Error growing workload");
+    }
+  }
+  TraceRecord *record = &w->records[w->n_records];
+  memset(record, 0, sizeof(*record));
+  record->ev.time.tv_sec = time_us / 1000000;
+  record->ev.time.tv_usec = time_us % 1000000;
+  record->ev.type = type;
+  record->ev.code = code;
+  record->ev.value = value;
+  record->device = device;
+  // Keep the generation order, to sort events with the same timestamp, in the
+  // delay unused by input events.
+  record->delay_us = w->n_records++;
+}
+
+// Append a frame made of a key event and its SYN_REPORT to a workload.
+void appendKey(Workload *w, int device, uint64_t time_us, int code,
+               int value) {
+  appendEvent(w, device, time_us, EV_KEY, code, value);
+  appendEvent(w, device, time_us, EV_SYN, SYN_REPORT, 0);
+}
+
+// Compare trace records by timestamp, then by generation order.
+int compareRecords(const void *a, const void *b) {
+  const TraceRecord *ra = a;
+  const TraceRecord *rb = b;
+  uint64_t ta = timevalUs(&ra->ev.time);
+  uint64_t tb = timevalUs(&rb->ev.time);
+  if (ta != tb) {
+    return ta < tb ? -1 : 1;
+  }
+  return ra->delay_us < rb->delay_us ? -1 : ra->delay_us > rb->delay_us;
+}
+
+// Sort the events of a synthetic workload by time, as they would be read.
+void sortWorkload(Workload *w) {
+  qsort(w->records, w->n_records, sizeof(TraceRecord), compareRecords);
+  for (size_t i = 0; i < w->n_records; i++) {
+    w->records[i].delay_us = 0;
+  }
+}
+
+// Append fast typing from the given keyboard to a workload, starting at the
+// given time, until it holds the given number of events: overlapping letters,
+// CAPSLOCK taps and CAPSLOCK chords.
+void appendTyping(Workload *w, int device, uint64_t time_us,
+                  size_t n_events) {
+  while (w->n_records < n_events) {
+    uint32_t kind = randomBetween(0, 19);
+    if (kind == 0) {
+      // Tap CAPSLOCK.
+      appendKey(w, device, time_us, KEY_CAPSLOCK, DOWN);
+      appendKey(w, device, time_us + randomBetween(50, 150) * 1000,
+                KEY_CAPSLOCK, UP);
+      time_us += 250000;
+    } else if (kind == 1) {
+      // Hold CAPSLOCK while typing a letter.
+      appendKey(w, device, time_us, KEY_CAPSLOCK, DOWN);
+      appendKey(w, device, time_us + 30000, KEY_C, DOWN);
+      appendKey(w, device, time_us + 80000, KEY_C, UP);
+      appendKey(w, device, time_us + 120000, KEY_CAPSLOCK, UP);
+      time_us += 200000;
+    } else {
+      // Type a letter, possibly still holding the previous one.
+      int code = KEY_Q + randomBetween(0, KEY_M - KEY_Q);
+      appendKey(w, device, time_us, code, DOWN);
+      appendKey(w, device, time_us + randomBetween(60, 100) * 1000, code, UP);
+      time_us += randomBetween(40, 120) * 1000;
+    }
+  }
+}
+
+// Generate the fast typing workload.
+void generateTyping(Workload *w, size_t n_events) {
+  appendTyping(w, 0, nowUs(), n_events);
+  sortWorkload(w);
+}
+
+// Generate the autorepeat workload: keys held down until the kernel repeats
+// them every 33ms, with CAPSLOCK taps in between.
+void generateAutorepeat(Workload *w, size_t n_events) {
+  uint64_t time_us = nowUs();
+  while (w->n_records < n_events) {
+    appendKey(w, 0, time_us, KEY_J, DOWN);
+    time_us += 250000;
+    for (int i = 0; i < 60; i++) {
+      appendKey(w, 0, time_us, KEY_J, 2);
+      time_us += 33000;
+    }
+    appendKey(w, 0, time_us, KEY_J, UP);
+    appendKey(w, 0, time_us + 100000, KEY_CAPSLOCK, DOWN);
+    appendKey(w, 0, time_us + 180000, KEY_CAPSLOCK, UP);
+    time_us += 300000;
+  }
+}
+
+// Generate the multi-keyboard workload: several keyboards typing at the same
+// time, interleaving their events.
+void generateMulti(Workload *w, size_t n_events) {
+  uint64_t time_us = nowUs();
+  for (int device = 0; device < MULTI_KEYBOARDS; device++) {
+    appendTyping(w, device, time_us + randomBetween(0, 100) * 1000,
+                 n_events * (device + 1) / MULTI_KEYBOARDS);
+  }
+  sortWorkload(w);
+}
+
+// Read a whole file into memory, returning its size. Fails on error.
+size_t readFile(const char *path, char **data) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    die("Error opening workload file");
+  }
+  size_t size = 0;
+  size_t capacity = 0;
+  *data = NULL;
+  size_t n;
+  do {
+    if (size == capacity) {
+      capacity = capacity ? capacity * 2 : 65536;
+      *data = realloc(*data, capacity);
+      if (*data == NULL) {
+        die("Error reading workload file");
+      }
+    }
+    n = fread(*data + size, 1, capacity - size, file);
+    size += n;
+  } while (n > 0);
+  if (ferror(file)) {
+    die("Error reading workload file");
+  }
+  fclose(file);
+  return size;
+}
+
+// Read the trace file at the given path into a buffer, returned in data, and
+// its header. Return the number of records, which follow the header in the
+// buffer. Fails on error.
+size_t readTrace(const char *path, char **data, TraceHeader *header) {
+  size_t size = readFile(path, data);
+  if (size < sizeof(*header)) {
+    die("Truncated trace file");
+  }
+  memcpy(header, *data, sizeof(*header));
+  if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version < 1 || header->version > TRACE_VERSION) {
+    die("Unsupported trace file");
+  }
+  return (size - sizeof(*header)) / sizeof(TraceRecord);
+}
+
+// Load a trace file as a workload. Fails on error.
+void loadTrace(Workload *w, const char *path) {
+  char *data;
+  TraceHeader header;
+  size_t n_records = readTrace(path, &data, &header);
+  for (size_t i = 0; i < n_records; i++) {
+    TraceRecord record;
+    memcpy(&record, data + sizeof(header) + i * sizeof(record),
+           sizeof(record));
+    // Only the input events are replayed, as dumped by the daemon.
+    if ((record.flags & 0xff) != TRACE_INPUT) {
+      continue;
+    }
+    appendEvent(w, record.device, timevalUs(&record.ev.time), record.ev.type,
+                record.ev.code, record.ev.value);
+  }
+  free(data);
+}
+
+// Print the distribution of the delays the daemon added to the output events of
+// a trace file, from their source event to their write to uinput, for each
+// keyboard. The delays are only recorded when measuring latencies. Fails on
+// error.
+void printTraceDelays(const char *path) {
+  char *data;
+  TraceHeader header;
+  size_t n_records = readTrace(path, &data, &header);
+  size_t n_devices = 0;
+  for (size_t i = 0; i < n_records; i++) {
+    TraceRecord record;
+    memcpy(&record, data + sizeof(header) + i * sizeof(record),
+           sizeof(record));
+    if (record.device >= n_devices) {
+      n_devices = record.device + 1;
+    }
+  }
+  Histogram *histograms = calloc(n_devices, sizeof(Histogram));
+  if (n_devices > 0 && histograms == NULL) {
+    die("Error allocating histograms");
+  }
+
+  // Delays of 0 were not measured.
+  for (size_t i = 0; i < n_records; i++) {
+    TraceRecord record;
+    memcpy(&record, data + sizeof(header) + i * sizeof(record),
+           sizeof(record));
+    if ((record.flags & 0xff) == TRACE_OUTPUT && record.delay_us != 0) {
+      histogramRecord(&histograms[record.device], record.delay_us);
+    }
+  }
+  for (size_t i = 0; i < n_devices; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "kbd%zu", i);
+    histograms[i].name = name;
+    if (histograms[i].count > 0) {
+      printHistogram(&histograms[i], "us");
+    }
+  }
+  free(histograms);
+  free(data);
+}
+
+// Sample the counters a running daemon publishes in the given statistics file
+// once a minute, for the given number of minutes, and print how often it woke
+// up: per minute without any input event, which should be never, and per key
+// press during the other minutes. Return 0 on success, -1 on error.
+int watchWakeups(const char *path, int minutes) {
+  const Stats *shared = mapStatsFile(path);
+  if (shared == NULL) {
+    return -1;
+  }
+  uint64_t idle_minutes = 0;
+  uint64_t idle_wakeups = 0;
+  uint64_t max_idle_wakeups = 0;
+  uint64_t active_wakeups = 0;
+  uint64_t timer_wakeups = 0;
+  uint64_t presses = 0;
+  Stats last = *shared;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  printf("minute    wakeups      timer    presses\n");
+  for (int i = 1; i <= minutes; i++) {
+    deadline.tv_sec += 60;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+           EINTR) {
+    }
+    Stats now = *shared;
+    uint64_t wakeups = now.wakeups - last.wakeups;
+    if (now.events == last.events) {
+      idle_minutes++;
+      idle_wakeups += wakeups;
+      if (wakeups > max_idle_wakeups) {
+        max_idle_wakeups = wakeups;
+      }
+    } else {
+      active_wakeups += wakeups;
+      timer_wakeups += now.timer_wakeups - last.timer_wakeups;
+      presses += now.presses - last.presses;
+    }
+    printf("%6d %10llu %10llu %10llu%s\n", i, (unsigned long long)wakeups,
+           (unsigned long long)(now.timer_wakeups - last.timer_wakeups),
+           (unsigned long long)(now.presses - last.presses),
+           now.events == last.events ? " idle" : "");
+    fflush(stdout);
+    last = now;
+  }
+  munmap((void *)shared, sizeof(Stats));
+
+  if (idle_minutes > 0) {
+    printf("idle: %llu minutes, %.2f wakeups/minute, max %llu\n",
+           (unsigned long long)idle_minutes,
+           (double)idle_wakeups / idle_minutes,
+           (unsigned long long)max_idle_wakeups);
+  }
+  if (presses > 0) {
+    printf("active: %llu presses, %.2f wakeups/press, %.2f timer/press\n",
+           (unsigned long long)presses, (double)active_wakeups / presses,
+           (double)timer_wakeups / presses);
+  }
+  return 0;
+}
+
+// Load a raw capture of a keyboard device, as made with
+// `cat /dev/input/eventN > FILE`, as a workload. Fails on error.
+void loadCapture(Workload *w, const char *path) {
+  char *data;
+  size_t size = readFile(path, &data);
+  size_t n_events = size / sizeof(struct input_event);
+  for (size_t i = 0; i < n_events; i++) {
+    struct input_event ev;
+    memcpy(&ev, data + i * sizeof(ev), sizeof(ev));
+    appendEvent(w, 0, timevalUs(&ev.time), ev.type, ev.code, ev.value);
+  }
+  free(data);
+}
+
+// Free the fake keyboards.
+void freeFakeKeyboards(void) {
+  for (size_t i = 0; i < n_keyboards; i++) {
+    free(keyboards[i]);
+  }
+  free(keyboards);
+  keyboards = NULL;
+  n_keyboards = 0;
+}
+
+// Seat the fake keyboards belong to, whose virtual keyboard is /dev/null unless
+// the real uinput device is benchmarked.
+Seat null_seat;
+Seat *bench_seat = &null_seat;
+
+// Replace the registered keyboards with the given number of fake ones, which
+// have no device.
+void addFakeKeyboards(size_t n) {
+  freeFakeKeyboards();
+  keyboards = calloc(n, sizeof(Keyboard *));
+  if (n > 0 && keyboards == NULL) {
+    die("Error allocating keyboards");
+  }
+  for (size_t i = 0; i < n; i++) {
+    keyboards[i] = calloc(1, sizeof(Keyboard));
+    if (keyboards[i] == NULL) {
+      die("Error allocating keyboard");
+    }
+    keyboards[i]->source.type = SOURCE_KEYBOARD;
+    keyboards[i]->source.fd = -1;
+    keyboards[i]->index = i;
+    keyboards[i]->seat = bench_seat;
+    keyboards[i]->dual_role.adaptive = bench_seat->adaptive;
+  }
+  n_keyboards = n;
+}
+
+// Replay a workload, one frame at a time as read from a keyboard, and print
+// the throughput and the distribution of the time taken per frame.
+void runWorkload(const Workload *w) {
+  struct input_event frame[MAX_EVENTS_PER_READ];
+  Histogram histogram;
+  memset(&histogram, 0, sizeof(histogram));
+  histogram.name = "frame";
+
+  // Start from a clean state, with a keyboard for each device of the
+  // workload: the registered ones are those the hold timer looks at. The
+  // adaptive timeout starts over too.
+  bench_seat->adaptive->samples = 0;
+  size_t n_devices = 0;
+  for (size_t i = 0; i < w->n_records; i++) {
+    if (w->records[i].device >= n_devices) {
+      n_devices = w->records[i].device + 1;
+    }
+  }
+  addFakeKeyboards(n_devices);
+
+  size_t n_frames = 0;
+  uint64_t start_ns = nowNs();
+  for (size_t i = 0; i < w->n_records;) {
+    // A frame ends with a SYN_REPORT, or when another keyboard takes over.
+    size_t n = 0;
+    int device = w->records[i].device;
+    while (i < w->n_records && w->records[i].device == device &&
+           n < MAX_EVENTS_PER_READ) {
+      frame[n] = w->records[i++].ev;
+      if (frame[n++].type == EV_SYN) {
+        break;
+      }
+    }
+
+    uint64_t frame_ns = nowNs();
+    handleEvents(keyboards[device], frame, n);
+    histogramRecord(&histogram, nowNs() - frame_ns);
+    n_frames++;
+  }
+  uint64_t elapsed_ns = nowNs() - start_ns;
+
+  fprintf(stderr, "%s: %zu events, %zu frames in %.3fms, %.0f events/s\n",
+          w->name, w->n_records, n_frames, elapsed_ns / 1e6,
+          elapsed_ns ? w->n_records * 1e9 / elapsed_ns : 0);
+  printHistogram(&histogram, "ns");
+}
+
+void printHelp(const char *program_name) {
+  printf("Usage: %s [-w WORKLOAD]... [-f TRACE]... [-r CAPTURE]...\n"
+         "       [-n EVENTS] [-c FILE] [-t TIMEOUT_MS] [-A MIN_MS:MAX_MS]\n"
+         "       [-m MAPPING]... [-g] [-u]\n"
+         "       [-T CHORD_MS] [-k CHORD]... [-L LAYER:KEY[:TARGET]]...\n"
+         "       [-d TRACE]\n"
+         "       [-W FILE [-M MINUTES]] [-h]\n",
+         program_name);
+  printf("Options:\n");
+  printf("  -w WORKLOAD    Run a synthetic workload: typing, autorepeat or\n");
+  printf("                 multi. Default: all of them.\n");
+  printf("  -f TRACE       Replay a trace file.\n");
+  printf("  -r CAPTURE     Replay a raw capture of a keyboard device.\n");
+  printf("  -n EVENTS      Number of events of synthetic workloads.\n");
+  printf("  -c FILE        Read timeout and mappings from FILE, as for\n");
+  printf("                 wlcape.\n");
+  printf("  -t TIMEOUT_MS  Timeout for generating a tap key event.\n");
+  printf("  -A MIN_MS:MAX_MS\n");
+  printf("                 Adapt the timeout within these bounds.\n");
+  printf("  -m MAPPING     Configure a dual-role key, as for wlcape.\n");
+  printf("  -T CHORD_MS    Time to press all the keys of a chord.\n");
+  printf("  -k CHORD       Configure a chord, as for wlcape.\n");
+  printf("  -L LAYER:KEY[:TARGET]\n");
+  printf("                 Configure a key of a layer, as for wlcape.\n");
+  printf("  -g             Remap events as when grabbing the keyboards.\n");
+  printf("  -u             Write to a real uinput device, instead of\n");
+  printf("                 /dev/null.\n");
+  printf("  -d TRACE       Print the delays added to the output events of\n");
+  printf("                 each keyboard in a trace taken with -l, and\n");
+  printf("                 exit.\n");
+  printf("  -W FILE        Count the wakeups of the daemon publishing its\n");
+  printf("                 counters in FILE, per idle minute and per key\n");
+  printf("                 press, and exit.\n");
+  printf("  -M MINUTES     Number of minutes to count them for. Default:\n");
+  printf("                 %d.\n", DEFAULT_WATCH_MINUTES);
+  printf("  -h             Display this help message.\n");
+}
+
+int main(int argc, char *argv[]) {
+  Workload workloads[32];
+  int n_workloads = 0;
+  size_t n_events = DEFAULT_WORKLOAD_EVENTS;
+  int real_uinput = 0;
+  const char *stats_file = NULL;
+  int minutes = DEFAULT_WATCH_MINUTES;
+  const char *config_file = NULL;
+
+  // Option parsing. Workloads are only generated once all options are known.
+  const char *names[32];
+  int kinds[32];
+  int opt;
+  while ((opt = getopt(argc, argv, "A:L:M:T:W:c:d:f:ghk:m:n:r:t:uw:")) != -1) {
+    switch (opt) {
+      case 'f':
+      case 'r':
+      case 'w':
+        if (n_workloads == 32) {
+          die("Too many workloads");
+        }
+        names[n_workloads] = optarg;
+        kinds[n_workloads++] = opt;
+        break;
+      case 'g':
+        grab = 1;
+        break;
+      case 'm':
+        if (addDualRoleKey(&default_config, optarg) < 0) {
+          fprintf(stderr, "Invalid mapping: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'T':
+        default_config.chord_ms = atoi(optarg);
+        break;
+      case 'k':
+        if (addChord(&default_config, optarg) < 0) {
+          fprintf(stderr, "Invalid chord: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'L':
+        if (addLayerKey(&default_config, optarg) < 0) {
+          fprintf(stderr, "Invalid layer key: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'c':
+        config_file = optarg;
+        break;
+      case 'n':
+        n_events = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        default_config.timeout_ms = atoi(optarg);
+        break;
+      case 'A':
+        if (parseAdaptiveBounds(&default_config, optarg) < 0) {
+          fprintf(stderr, "Invalid adaptive timeout bounds: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'u':
+        real_uinput = 1;
+        break;
+      case 'd':
+        printTraceDelays(optarg);
+        return 0;
+      case 'W':
+        stats_file = optarg;
+        break;
+      case 'M':
+        minutes = atoi(optarg);
+        break;
+      case 'h':
+        printHelp(argv[0]);
+        return 0;
+      default:
+        printHelp(argv[0]);
+        return 1;
+    }
+  }
+  if (stats_file != NULL) {
+    return watchWakeups(stats_file, minutes) < 0 ? 1 : 0;
+  }
+  if (n_workloads == 0) {
+    names[0] = "typing";
+    names[1] = "autorepeat";
+    names[2] = "multi";
+    kinds[0] = kinds[1] = kinds[2] = 'w';
+    n_workloads = 3;
+  }
+  if (default_config.n_dual_role_keys == 0) {
+    addDualRoleKey(&default_config, "capslock:esc:leftctrl");
+  }
+  // The configuration file overrides the command line, as in the daemon.
+  if (config_file != NULL) {
+    Config *c = malloc(sizeof(Config));
+    if (c == NULL) {
+      die("Error allocating configuration");
+    }
+    if (loadConfig(config_file, c) < 0) {
+      return 1;
+    }
+    replaceConfig(c);
+    applyConfig();
+  }
+
+  // Generate or load the workloads.
+  for (int i = 0; i < n_workloads; i++) {
+    Workload *w = &workloads[i];
+    memset(w, 0, sizeof(*w));
+    w->name = names[i];
+    if (kinds[i] == 'f') {
+      loadTrace(w, names[i]);
+    } else if (kinds[i] == 'r') {
+      loadCapture(w, names[i]);
+    } else if (strcmp(names[i], "typing") == 0) {
+      generateTyping(w, n_events);
+    } else if (strcmp(names[i], "autorepeat") == 0) {
+      generateAutorepeat(w, n_events);
+    } else if (strcmp(names[i], "multi") == 0) {
+      generateMulti(w, n_events);
+    } else {
+      fprintf(stderr, "Unknown workload: %s\n", names[i]);
+      return 1;
+    }
+  }
+
+  // Setup the uinput sink, and the hold timer, which is armed as in the
+  // daemon but never waited for.
+  if (real_uinput) {
+    bench_seat = addSeat(-1, DEFAULT_SEAT, -1);
+    if (bench_seat == NULL) {
+      die("Error creating uinput device");
+    }
+  } else {
+    null_seat.source.fd = open("/dev/null", O_WRONLY);
+    if (null_seat.source.fd < 0) {
+      die("Error opening /dev/null");
+    }
+    bindAdaptiveState(&null_seat);
+  }
+  uinputSelect(bench_seat);
+  if (grab) {
+    timer_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer_source.fd < 0) {
+      die("Error creating hold timer");
+    }
+  }
+
+  for (int i = 0; i < n_workloads; i++) {
+    runWorkload(&workloads[i]);
+    free(workloads[i].records);
+  }
+  freeFakeKeyboards();
+
+  if (real_uinput) {
+    removeSeats();
+  } else {
+    close(null_seat.source.fd);
+  }
+  return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Chords: keys sending another key when pressed together, detected when
+// grabbing before the events reach the dual-role keys.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "wlcape.h"
+
+// Return the time at which the keys held back on the given chord state can no
+// longer make up a chord, in microseconds.
+uint64_t chordDeadline(const ChordState *chord) {
+  return timevalUs(&chord->start) + config->chord_ms * 1000ULL;
+}
+
+// Return whether the given chord is made of the given key.
+int chordHasKey(const Chord *c, int code) {
+  for (int i = 0; i < c->n_keys; i++) {
+    if (c->keys[i] == code) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Stop waiting for the keys held back on the given keyboard to make up a
+// chord. If they match one, press its output key in their place, otherwise
+// handle the first one as it is and look for chords again among the events
+// that followed it. Return 0 on success, -1 on error.
+int resolveChord(Keyboard *kbd) {
+  ChordState *chord = &kbd->chord;
+  struct input_event events[MAX_CHORD_EVENTS];
+  size_t n_events = chord->n_held_back;
+  memcpy(events, chord->held_back, n_events * sizeof(events[0]));
+  uint32_t matched = chord->candidates & config->chord_sizes[chord->n_keys];
+  chord->candidates = 0;
+  chord->n_keys = 0;
+  chord->n_held_back = 0;
+
+  int ret = 0;
+  if (matched == 0) {
+    ret = handleEvent(&kbd->dual_role, &events[0]);
+    for (size_t i = 1; i < n_events; i++) {
+      if (handleChordEvent(kbd, &events[i]) < 0) {
+        ret = -1;
+      }
+    }
+    return ret;
+  }
+
+  int slot = __builtin_ctz(matched);
+  const Chord *c = &config->chords[slot];
+  chord->active |= 1U << slot;
+  chord->output_down |= 1U << slot;
+  chord->keys_down[slot] = (1U << c->n_keys) - 1;
+
+  // The output key is pressed at the time of the last key of the chord, and
+  // the events of its keys are dropped.
+  size_t last = 0;
+  for (size_t i = 0; i < n_events; i++) {
+    if (events[i].type == EV_KEY && events[i].value == DOWN) {
+      last = i;
+    }
+  }
+  for (size_t i = 0; i < n_events; i++) {
+    struct input_event *ev = &events[i];
+    if (i == last) {
+      ev->code = c->output;
+      traceEvent(ev, TRACE_FLAGS(TRACE_DECISION, DECISION_CHORD));
+    } else if ((ev->type == EV_KEY && chordHasKey(c, ev->code)) ||
+               (ev->type == EV_MSC && ev->code == MSC_SCAN)) {
+      continue;
+    }
+    if (handleEvent(&kbd->dual_role, ev) < 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+// Resolve the chord being pressed on the given keyboard, if it can no longer
+// be completed at the time of the given event. Return 0 on success, -1 on
+// error.
+int expireChord(Keyboard *kbd, const struct input_event *ev) {
+  if (kbd->chord.candidates == 0 ||
+      chordDeadline(&kbd->chord) > timevalUs(&ev->time)) {
+    return 0;
+  }
+  return resolveChord(kbd);
+}
+
+// Handle an event of a key of the chords pressed on the given keyboard. The
+// output key is released along with the first of them, and the other events of
+// their keys are dropped. Return 1 if the event was handled, 0 if it is not
+// part of such a chord, -1 on error.
+int handleActiveChordKey(Keyboard *kbd, struct input_event *ev) {
+  ChordState *chord = &kbd->chord;
+  uint32_t mask = chord->active & config->chord_masks[ev->code];
+  for (; mask != 0; mask &= mask - 1) {
+    int slot = __builtin_ctz(mask);
+    const Chord *c = &config->chords[slot];
+    for (int i = 0; i < c->n_keys; i++) {
+      if (c->keys[i] != ev->code || !(chord->keys_down[slot] & (1U << i))) {
+        continue;
+      }
+      uint32_t bit = 1U << slot;
+      if (ev->value == UP) {
+        chord->keys_down[slot] &= ~(1U << i);
+        if (chord->keys_down[slot] == 0) {
+          chord->active &= ~bit;
+        }
+      }
+      if (!(chord->output_down & bit)) {
+        return 1;
+      }
+      if (ev->value == UP) {
+        chord->output_down &= ~bit;
+      }
+      struct input_event output = *ev;
+      output.code = c->output;
+      return handleEvent(&kbd->dual_role, &output) < 0 ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+// Return whether the key of the given event was pressed among the events held
+// back on the given chord state.
+int isChordKeyHeldBack(const ChordState *chord,
+                       const struct input_event *ev) {
+  for (size_t i = 0; i < chord->n_held_back; i++) {
+    const struct input_event *held_back = &chord->held_back[i];
+    if (held_back->type == EV_KEY && held_back->code == ev->code &&
+        held_back->value == DOWN) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Handle an event of the given keyboard, holding back the presses of keys that
+// may make up a chord, and the events following them, until either all the
+// keys of a chord are pressed, another key is pressed or one of them is
+// released, or the chord timeout expires. Chords are matched by ANDing the
+// masks of the chords including each key. Return 0 on success, -1 on error.
+int handleChordEvent(Keyboard *kbd, struct input_event *ev) {
+  ChordState *chord = &kbd->chord;
+  if (!grab || config->n_chords == 0) {
+    return handleEvent(&kbd->dual_role, ev);
+  }
+  if (expireChord(kbd, ev) < 0) {
+    return -1;
+  }
+
+  int is_key = ev->type == EV_KEY && ev->code < KEY_CNT;
+  if (is_key && chord->active != 0) {
+    int ret = handleActiveChordKey(kbd, ev);
+    if (ret != 0) {
+      return ret < 0 ? -1 : 0;
+    }
+  }
+
+  // Wait for the other keys of the chords including a pressed key.
+  if (chord->candidates == 0) {
+    uint32_t mask =
+        is_key && ev->value == DOWN ? config->chord_masks[ev->code] : 0;
+    if (mask == 0) {
+      return handleEvent(&kbd->dual_role, ev);
+    }
+    chord->start = ev->time;
+    chord->candidates = mask;
+    chord->n_keys = 1;
+    chord->held_back[0] = *ev;
+    chord->n_held_back = 1;
+    return 0;
+  }
+
+  if (chord->n_held_back < MAX_CHORD_EVENTS) {
+    if (is_key && ev->value == DOWN) {
+      uint32_t mask = chord->candidates & config->chord_masks[ev->code];
+      if (mask != 0) {
+        chord->candidates = mask;
+        chord->n_keys++;
+        chord->held_back[chord->n_held_back++] = *ev;
+        // Press the chord right away, unless more keys can still make up a
+        // bigger one.
+        uint32_t matched = mask & config->chord_sizes[chord->n_keys];
+        return matched != 0 && (mask & ~matched) == 0 ? resolveChord(kbd) : 0;
+      }
+    } else if (!is_key || ev->value != UP || !isChordKeyHeldBack(chord, ev)) {
+      chord->held_back[chord->n_held_back++] = *ev;
+      return 0;
+    }
+  }
+
+  // Pressing a key that is not part of the chords, or releasing one of the
+  // keys held back, ends the chord.
+  if (resolveChord(kbd) < 0) {
+    return -1;
+  }
+  return handleChordEvent(kbd, ev);
+}
+
+// Release the output keys of the chords of the given keyboard, which is being
+// removed, and forget the events held back.
+void resetChordState(Keyboard *kbd) {
+  ChordState *chord = &kbd->chord;
+  if (grab && chord->output_down != 0) {
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EV_KEY;
+    for (uint32_t mask = chord->output_down; mask != 0; mask &= mask - 1) {
+      int code = config->chords[__builtin_ctz(mask)].output;
+      if (uinputQueueEvent(&ev, code, UP, DECISION_RESET) < 0) {
+        warn("Error while queueing chord key event");
+      }
+    }
+    if (uinputFlush() < 0) {
+      warn("Error while writing events to uinput");
+    }
+  }
+  chord->candidates = 0;
+  chord->n_keys = 0;
+  chord->active = 0;
+  chord->output_down = 0;
+  chord->n_held_back = 0;
+}
+
+// Add a chord to the table of the given configuration, given a mapping in the
+// KEY+KEY[+KEY...]:OUTPUT format. Return 0 on success, -1 on error.
+int addChord(Config *c, const char *mapping) {
+  char buffer[128];
+  if (strlen(mapping) >= sizeof(buffer) || c->n_chords >= MAX_CHORDS) {
+    return -1;
+  }
+  strcpy(buffer, mapping);
+  char *colon = strchr(buffer, ':');
+  if (colon == NULL) {
+    return -1;
+  }
+  *colon = '\0';
+  int output = parseKey(colon + 1);
+
+  // Chords made of the same keys are told apart by the masks of those
+  // including each of them.
+  Chord *chord = &c->chords[c->n_chords];
+  chord->n_keys = 0;
+  uint32_t same = ~0U;
+  for (char *name = strtok(buffer, "+"); name != NULL;
+       name = strtok(NULL, "+")) {
+    int key = parseKey(name);
+    if (key < 0 || chord->n_keys == MAX_CHORD_KEYS || chordHasKey(chord, key)) {
+      return -1;
+    }
+    chord->keys[chord->n_keys++] = key;
+    same &= c->chord_masks[key];
+  }
+  if (output < 0 || chord->n_keys < 2 ||
+      (same & c->chord_sizes[chord->n_keys]) != 0) {
+    return -1;
+  }
+  chord->output = output;
+
+  uint32_t bit = 1U << c->n_chords++;
+  for (int i = 0; i < chord->n_keys; i++) {
+    c->chord_masks[chord->keys[i]] |= bit;
+  }
+  c->chord_sizes[chord->n_keys] |= bit;
+  return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Configuration file, reloaded whenever it changes.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Inotify instance watching the directory of the configuration file, as
+// editors often replace the file rather than write to it. Path of the file,
+// and its name within that directory.
+Source config_source = {SOURCE_CONFIG, -1};
+const char *config_path = NULL;
+const char *config_name = NULL;
+
+// Remove the whitespace around the given string, in place.
+char *strip(char *s) {
+  while (*s == ' ' || *s == '\t') {
+    s++;
+  }
+  size_t length = strlen(s);
+  while (length > 0 && strchr(" \t\r\n", s[length - 1]) != NULL) {
+    s[--length] = '\0';
+  }
+  return s;
+}
+
+// Load the configuration file at the given path into the given configuration,
+// on top of the one given on the command line. The file is made of
+// "NAME = VALUE" lines, where NAME is "timeout_ms", "chord_ms",
+// "adaptive_timeout_ms", bounds in the MIN_MS:MAX_MS format, "map", a
+// mapping in the KEY:TAP[:HOLD[:POLICY[:QUICK_TAP_MS]]] format, or "chord", a
+// chord in the KEY+KEY[+KEY...]:OUTPUT format, or "layer", keys of a layer in
+// the LAYER:KEY:TARGET or LAYER:LAYOUT format. All but the timeouts can be
+// repeated, and "#" starts a comment.
+// The file is read from the given fd, which is closed, and its path is only
+// used in error messages. Return 0 on success, -1 on error.
+int loadConfigFd(int fd, const char *path, Config *c) {
+  FILE *file = fdopen(fd, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error reading %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  *c = default_config;
+  int has_mappings = 0;
+  int has_chords = 0;
+  int has_layers = 0;
+  int line_number = 0;
+  char line[256];
+  int ret = 0;
+  while (ret == 0 && fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    ret = -1;
+    if (strchr(line, '\n') == NULL && !feof(file)) {
+      break;
+    }
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char *name = strip(line);
+    if (*name == '\0') {
+      ret = 0;
+      continue;
+    }
+    char *equals = strchr(name, '=');
+    if (equals == NULL) {
+      break;
+    }
+    *equals = '\0';
+    name = strip(name);
+    char *value = strip(equals + 1);
+
+    if (strcmp(name, "timeout_ms") == 0 || strcmp(name, "chord_ms") == 0) {
+      char *end;
+      long timeout = strtol(value, &end, 10);
+      if (*value == '\0' || *end != '\0' || timeout < 0 || timeout > 60000) {
+        break;
+      }
+      if (strcmp(name, "timeout_ms") == 0) {
+        c->timeout_ms = timeout;
+      } else {
+        c->chord_ms = timeout;
+      }
+    } else if (strcmp(name, "adaptive_timeout_ms") == 0) {
+      if (parseAdaptiveBounds(c, value) < 0) {
+        break;
+      }
+    } else if (strcmp(name, "map") == 0) {
+      // The mappings of the file replace those of the command line.
+      if (!has_mappings) {
+        c->n_dual_role_keys = 0;
+        memset(c->dual_role_slots, 0, sizeof(c->dual_role_slots));
+        has_mappings = 1;
+      }
+      if (addDualRoleKey(c, value) < 0) {
+        break;
+      }
+    } else if (strcmp(name, "chord") == 0) {
+      // So do the chords.
+      if (!has_chords) {
+        c->n_chords = 0;
+        memset(c->chord_masks, 0, sizeof(c->chord_masks));
+        memset(c->chord_sizes, 0, sizeof(c->chord_sizes));
+        has_chords = 1;
+      }
+      if (addChord(c, value) < 0) {
+        break;
+      }
+    } else if (strcmp(name, "layer") == 0) {
+      // And so do the layers.
+      if (!has_layers) {
+        memset(c->layers, 0, sizeof(c->layers));
+        has_layers = 1;
+      }
+      if (addLayerKey(c, value) < 0) {
+        break;
+      }
+    } else {
+      break;
+    }
+    ret = 0;
+  }
+  if (ret < 0) {
+    fprintf(stderr, "%s:%d: Invalid setting\n", path, line_number);
+  } else if (ferror(file)) {
+    fprintf(stderr, "Error reading %s\n", path);
+    ret = -1;
+  }
+  fclose(file);
+  return ret;
+}
+
+// Load the configuration file at the given path into the given configuration,
+// as loadConfigFd() does. Return 0 on success, -1 on error.
+int loadConfig(const char *path, Config *c) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return loadConfigFd(fd, path, c);
+}
+
+// Watch the configuration file at the given path for changes, adding the
+// inotify instance to the epoll instance. Return 0 on success, -1 on error.
+int addConfigWatch(int epoll_fd, const char *path) {
+  config_path = path;
+  char dir[4096] = ".";
+  const char *slash = strrchr(path, '/');
+  config_name = slash != NULL ? slash + 1 : path;
+  if (slash != NULL) {
+    size_t length = slash == path ? 1 : (size_t)(slash - path);
+    if (length >= sizeof(dir)) {
+      return -1;
+    }
+    memcpy(dir, path, length);
+    dir[length] = '\0';
+  }
+
+  config_source.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (config_source.fd < 0) {
+    return -1;
+  }
+  uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO;
+  if (inotify_add_watch(config_source.fd, dir, mask) < 0 ||
+      addSource(epoll_fd, &config_source, EPOLLIN) < 0) {
+    close(config_source.fd);
+    config_source.fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// Reload the configuration file from the given fd, which is closed, or from its
+// path if -1. The new configuration is parsed into a fresh table, swapped in
+// between frames, and the current one is kept if the file is invalid.
+void reloadConfig(int fd) {
+  Config *c = malloc(sizeof(Config));
+  if (c == NULL) {
+    warn("Error allocating configuration");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  int ret = fd >= 0 ? loadConfigFd(fd, config_path, c)
+                    : loadConfig(config_path, c);
+  if (ret < 0) {
+    warn("Keeping the current configuration");
+    free(c);
+    return;
+  }
+  replaceConfig(c);
+}
+
+// Handle changes in the directory of the configuration file, reloading it if
+// it has been written or replaced.
+void handleConfigEvents(void) {
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+  ssize_t n_bytes;
+  while ((n_bytes = read(config_source.fd, buffer, sizeof(buffer))) > 0) {
+    const struct inotify_event *ev;
+    for (char *p = buffer; p < buffer + n_bytes; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *)p;
+      if (ev->mask & IN_Q_OVERFLOW ||
+          (ev->len > 0 && strcmp(ev->name, config_name) == 0)) {
+        changed = 1;
+      }
+    }
+  }
+  if (!changed) {
+    return;
+  }
+  // Once unprivileged, the file can only be opened by the helper, and is
+  // reloaded when it passes it back.
+  if (files_from_helper) {
+    requestHelperFile(HELPER_CONFIG);
+    return;
+  }
+  reloadConfig(-1);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Log-linear latency histograms.
+
+#include <stdio.h>
+
+#include "wlcape.h"
+
+// Whether to measure latencies, the histograms for each stage, and the time
+// of the current epoll_wait() wakeup.
+int measure_latency = 0;
+Histogram latencies[N_STAGES] = {
+    {.name = "wake"},  {.name = "read"},  {.name = "handle"},
+    {.name = "flush"}, {.name = "total"}, {.name = "inject"},
+};
+uint64_t wake_time_us = 0;
+
+// Return the index of the histogram bucket for the given value.
+int histogramBucket(uint64_t value) {
+  if (value < (1 << HISTOGRAM_SUB_BITS)) {
+    return value;
+  }
+  int bits = 63 - __builtin_clzll(value);
+  if (bits >= HISTOGRAM_MAX_BITS) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  int shift = bits - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+         ((value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+// Return the lowest value falling in the given histogram bucket.
+uint64_t histogramBucketValue(int bucket) {
+  if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+    return bucket;
+  }
+  int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+  return ((1ULL << HISTOGRAM_SUB_BITS) + sub) << shift;
+}
+
+// Record a value in the given histogram. Negative values, which happen if the
+// clocks involved are not in sync, are counted as zero.
+void histogramRecord(Histogram *h, int64_t value) {
+  uint64_t v = value > 0 ? value : 0;
+  h->buckets[histogramBucket(v)]++;
+  h->count++;
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+// Return an estimate of the given quantile of a histogram, as the lowest value
+// of the bucket it falls in.
+uint64_t histogramQuantile(const Histogram *h, double quantile) {
+  uint64_t rank = quantile * h->count;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > rank) {
+      return histogramBucketValue(i);
+    }
+  }
+  return h->max;
+}
+
+// Print the count, main quantiles and maximum of a histogram to stderr, with
+// values in the given unit.
+void printHistogram(const Histogram *h, const char *unit) {
+  fprintf(stderr,
+          "%-8s count %llu p50 %llu%s p99 %llu%s p999 %llu%s max %llu%s\n",
+          h->name, (unsigned long long)h->count,
+          (unsigned long long)histogramQuantile(h, 0.5), unit,
+          (unsigned long long)histogramQuantile(h, 0.99), unit,
+          (unsigned long long)histogramQuantile(h, 0.999), unit,
+          (unsigned long long)h->max, unit);
+}
+
+// Print the latency histograms of each stage to stderr.
+void dumpLatencies(void) {
+  for (int i = 0; i < N_STAGES; i++) {
+    printHistogram(&latencies[i], "us");
+  }
+}
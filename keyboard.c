@@ -0,0 +1,632 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Keyboard devices: enumeration, hotplug and LED forwarding.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <libudev.h>
+#include <linux/uinput.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+Keyboard **keyboards = NULL;  // Keyboards being monitored.
+size_t n_keyboards = 0;       // Number of keyboards being monitored.
+size_t max_keyboards = 0;     // Allocated size of the keyboards table.
+
+// Keyboards with events left to read, in the order they are read in. Only
+// used with epoll, which reports keyboards becoming readable just once.
+Keyboard *ready_keyboards = NULL;
+Keyboard *last_ready_keyboard = NULL;
+
+// Keyboards removed while handling a batch of epoll events, which may still
+// be referenced by the rest of the batch. Freed once the batch is done.
+Keyboard *closed_keyboards = NULL;
+
+// Devices to monitor and to ignore, matching udev properties with shell
+// patterns. Devices monitored are those matching any allow rule, if there is
+// one, and no deny rule.
+DeviceMatch allow_matches[MAX_DEVICE_MATCHES];
+size_t n_allow_matches = 0;
+DeviceMatch deny_matches[MAX_DEVICE_MATCHES];
+size_t n_deny_matches = 0;
+
+// Forward the LED events sent to the virtual keyboard of the given seat to
+// every keyboard of the seat we grabbed, as they would otherwise never reach
+// the real devices.
+void handleUinputEvents(Seat *seat) {
+  struct input_event events[MAX_EVENTS_PER_READ];
+  ssize_t n_bytes = read(seat->source.fd, events, sizeof(events));
+  if (n_bytes < 0) {
+    if (errno != EAGAIN) {
+      warn("Error reading events from uinput");
+    }
+    return;
+  }
+
+  // Only keep LED events, and terminate them with a SYN_REPORT.
+  size_t n_leds = 0;
+  for (size_t i = 0; i < n_bytes / sizeof(struct input_event); i++) {
+    if (events[i].type == EV_LED) {
+      events[n_leds++] = events[i];
+    }
+  }
+  if (n_leds == 0) {
+    return;
+  }
+  memset(&events[n_leds], 0, sizeof(struct input_event));
+  events[n_leds].type = EV_SYN;
+  events[n_leds].code = SYN_REPORT;
+  n_leds++;
+
+  for (size_t i = 0; i < n_keyboards; i++) {
+    if (keyboards[i]->seat != seat) {
+      continue;
+    }
+    if (write(keyboards[i]->source.fd, events,
+              n_leds * sizeof(struct input_event)) < 0) {
+      warn("Error setting keyboard LEDs");
+    }
+  }
+}
+
+// Set the given bit in a bitmask made of longs, as used by evdev ioctls.
+void setBit(unsigned long *bits, unsigned int bit) {
+  bits[bit / LONG_BITS] |= 1UL << (bit % LONG_BITS);
+}
+
+// Ask the kernel to only report the events we need from the given keyboard:
+// key events, excluding mouse, joystick and gamepad buttons. When grabbing,
+// all the keys and relative motion are needed, as they are forwarded.
+// SYN_REPORTs are never masked, but the kernel drops them when the whole frame
+// was filtered out. Return 0 on success, -1 on error.
+int setEventMask(int fd) {
+  unsigned long types[N_LONGS(EV_CNT)];
+  memset(types, 0, sizeof(types));
+  setBit(types, EV_KEY);
+  if (grab) {
+    setBit(types, EV_REL);
+  }
+
+  unsigned long keys[N_LONGS(KEY_CNT)];
+  memset(keys, 0, sizeof(keys));
+  for (unsigned int code = 0; code < KEY_CNT; code++) {
+    if (grab || code < BTN_MISC || code > BTN_GEAR_UP) {
+      setBit(keys, code);
+    }
+  }
+
+  // The mask for EV_SYN selects which event types are reported.
+  struct input_mask mask;
+  mask.type = EV_SYN;
+  mask.codes_size = sizeof(types);
+  mask.codes_ptr = (uintptr_t)types;
+  if (ioctl(fd, EVIOCSMASK, &mask) < 0) {
+    return -1;
+  }
+  mask.type = EV_KEY;
+  mask.codes_size = sizeof(keys);
+  mask.codes_ptr = (uintptr_t)keys;
+  return ioctl(fd, EVIOCSMASK, &mask);
+}
+
+// Find the monitored keyboard with the given device number, or NULL if none.
+Keyboard *findKeyboard(dev_t devnum) {
+  for (size_t i = 0; i < n_keyboards; i++) {
+    if (keyboards[i]->devnum == devnum) {
+      return keyboards[i];
+    }
+  }
+  return NULL;
+}
+
+// Start monitoring the keyboard device open as the given fd, with the given
+// device number, as part of the given seat, taking ownership of the fd. Return
+// 0 on success, -1 on error.
+int addKeyboardFd(int epoll_fd, int fd, dev_t devnum, Seat *seat) {
+  // Make room in the keyboards table.
+  if (n_keyboards == max_keyboards) {
+    size_t new_max = max_keyboards ? max_keyboards * 2 : 4;
+    Keyboard **new_keyboards = realloc(keyboards, new_max * sizeof(Keyboard *));
+    if (new_keyboards == NULL) {
+      warn("Error growing the keyboards table");
+      close(fd);
+      return -1;
+    }
+    keyboards = new_keyboards;
+    max_keyboards = new_max;
+  }
+
+  // Take exclusive access to the keyboard, all of its events are going to
+  // be forwarded through the virtual keyboard.
+  if (grab && ioctl(fd, EVIOCGRAB, 1) < 0) {
+    warn("Error grabbing keyboard device");
+    close(fd);
+    return -1;
+  }
+  // Timestamp events with the monotonic clock, so that tap timing is not
+  // affected by wall clock adjustments.
+  int clock_id = CLOCK_MONOTONIC;
+  if (ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0) {
+    warn("Error setting keyboard device clock");
+    close(fd);
+    return -1;
+  }
+  // Not being woken up for events we don't need is only an optimization, and
+  // the ioctl is not supported by older kernels.
+  if (setEventMask(fd) < 0) {
+    warn("Error setting keyboard device event mask, ignoring");
+  }
+
+  // Allocate the keyboard, which stays at the same address while monitored.
+  Keyboard *kbd;
+  if (posix_memalign((void **)&kbd, 64, sizeof(Keyboard)) != 0) {
+    warn("Error allocating keyboard");
+    close(fd);
+    return -1;
+  }
+  kbd->source.type = SOURCE_KEYBOARD;
+  kbd->source.fd = fd;
+  kbd->devnum = devnum;
+  kbd->next_closed = NULL;
+  kbd->next_ready = NULL;
+  kbd->ready = 0;
+  kbd->reading = 0;
+  kbd->seat = seat;
+  memset(&kbd->chord, 0, sizeof(kbd->chord));
+  memset(&kbd->dual_role, 0, sizeof(kbd->dual_role));
+  kbd->dual_role.adaptive = seat->adaptive;
+
+  // Read the keyboard with io_uring, or add its fd to the epoll instance.
+  if (uring_fd >= 0) {
+    uringReadKeyboard(kbd);
+  } else if (addSource(epoll_fd, &kbd->source, EPOLLIN | EPOLLET) < 0) {
+    warn("Error adding keyboard fd to epoll instance");
+    close(fd);
+    free(kbd);
+    return -1;
+  }
+
+  kbd->index = n_keyboards;
+  keyboards[n_keyboards++] = kbd;
+  stats->keyboards = n_keyboards;
+  return 0;
+}
+
+// Open the keyboard device at the given path, for reading and for setting its
+// LEDs when grabbing. Reads must not block when posted to io_uring. Return the
+// fd, or -1 on error.
+int openKeyboard(const char *path) {
+  return open(path, (grab ? O_RDWR : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+}
+
+// Add a rule to monitor, or with deny to ignore, the devices matching the
+// given PROPERTY=PATTERN rule. Return 0 on success, -1 on error.
+int addDeviceMatch(const char *rule, int deny) {
+  DeviceMatch *matches = deny ? deny_matches : allow_matches;
+  size_t *n_matches = deny ? &n_deny_matches : &n_allow_matches;
+  const char *equals = strchr(rule, '=');
+  size_t length = equals ? (size_t)(equals - rule) : 0;
+  if (length == 0 || length >= sizeof(matches->property) ||
+      *n_matches == MAX_DEVICE_MATCHES) {
+    return -1;
+  }
+  DeviceMatch *match = &matches[(*n_matches)++];
+  memcpy(match->property, rule, length);
+  match->property[length] = '\0';
+  match->pattern = equals + 1;
+  return 0;
+}
+
+// Return the value of the given udev property of an input event device,
+// looking at its parent input device too, or NULL if it has none. NAME is the
+// name of the device as reported by the kernel.
+const char *deviceProperty(struct udev_device *device, const char *property) {
+  struct udev_device *parent = udev_device_get_parent(device);
+  if (strcmp(property, "NAME") == 0) {
+    return parent ? udev_device_get_sysattr_value(parent, "name") : NULL;
+  }
+  const char *value = udev_device_get_property_value(device, property);
+  if (value == NULL && parent != NULL) {
+    value = udev_device_get_property_value(parent, property);
+  }
+  return value;
+}
+
+// Return whether the given udev device matches any of the given rules.
+int matchDevice(struct udev_device *device, const DeviceMatch *matches,
+                size_t n_matches) {
+  for (size_t i = 0; i < n_matches; i++) {
+    const char *value = deviceProperty(device, matches[i].property);
+    if (value != NULL && fnmatch(matches[i].pattern, value, 0) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Return whether the given udev device is a keyboard to monitor.
+int isMonitoredKeyboard(struct udev_device *device) {
+  // Only consider keyboard devices with an associated devnode.
+  const char *devnode = udev_device_get_devnode(device);
+  const char *keyboard =
+      udev_device_get_property_value(device, "ID_INPUT_KEYBOARD");
+  if (devnode == NULL || keyboard == NULL || strcmp(keyboard, "1") != 0) {
+    return 0;
+  }
+  // Only event devices, as enumerateKeyboards() matches, since hotplugged
+  // legacy mouse and joystick nodes can have the keyboard property too.
+  const char *sysname = udev_device_get_sysname(device);
+  if (sysname == NULL || strncmp(sysname, "event", strlen("event")) != 0) {
+    return 0;
+  }
+  // Never monitor our own virtual keyboards.
+  struct udev_device *parent = udev_device_get_parent(device);
+  const char *phys =
+      parent != NULL ? udev_device_get_sysattr_value(parent, "phys") : NULL;
+  if (phys != NULL &&
+      strncmp(phys, UINPUT_PHYS_PREFIX, strlen(UINPUT_PHYS_PREFIX)) == 0) {
+    return 0;
+  }
+  // Skip the devices filtered out by the user, like power buttons or security
+  // keys.
+  return (n_allow_matches == 0 ||
+          matchDevice(device, allow_matches, n_allow_matches)) &&
+         !matchDevice(device, deny_matches, n_deny_matches);
+}
+
+// Open the given udev device and start monitoring it, if it is a keyboard
+// that is not monitored yet. Return 0 on success (including when the device is
+// ignored), -1 on error.
+int addKeyboard(int epoll_fd, struct udev_device *device) {
+  if (!isMonitoredKeyboard(device)) {
+    return 0;
+  }
+  const char *devnode = udev_device_get_devnode(device);
+  // A device can be both enumerated and reported by the monitor at startup.
+  dev_t devnum = udev_device_get_devnum(device);
+  if (findKeyboard(devnum) != NULL) {
+    return 0;
+  }
+
+  const char *seat_name = deviceProperty(device, "ID_SEAT");
+  if (seat_name == NULL) {
+    seat_name = DEFAULT_SEAT;
+  }
+  int fd = openKeyboard(devnode);
+  if (fd < 0) {
+    warn("Error opening keyboard device");
+    return -1;
+  }
+  // The privileged helper passes the keyboard to the event loop instead.
+  if (event_loop_fd >= 0) {
+    return sendKeyboard(fd, devnum, seat_name);
+  }
+
+  // The events of the keyboard go to the virtual keyboard of its seat, which
+  // is created along with its first keyboard.
+  Seat *seat = addSeat(epoll_fd, seat_name, -1);
+  if (seat == NULL) {
+    warn("Error adding keyboard seat");
+    close(fd);
+    return -1;
+  }
+  return addKeyboardFd(epoll_fd, fd, devnum, seat);
+}
+
+// Return the device number of the evdev device open as the given fd, or 0 if
+// it is not one.
+dev_t evdevDevnum(int fd) {
+  struct stat st;
+  int version;
+  if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode) ||
+      ioctl(fd, EVIOCGVERSION, &version) < 0) {
+    return 0;
+  }
+  return st.st_rdev;
+}
+
+// Open the keyboard device at the given path, like /dev/input/event0, and
+// start monitoring it, without asking udev, as part of the default seat.
+// Return 0 on success, -1 on error.
+int addKeyboardPath(int epoll_fd, const char *path) {
+  int fd = openKeyboard(path);
+  if (fd < 0) {
+    warn("Error opening keyboard device");
+    return -1;
+  }
+  dev_t devnum = evdevDevnum(fd);
+  if (devnum == 0) {
+    warn("Not an input event device");
+    close(fd);
+    return -1;
+  }
+  if (findKeyboard(devnum) != NULL) {
+    close(fd);
+    return 0;
+  }
+  return addKeyboardFd(epoll_fd, fd, devnum, findSeat(DEFAULT_SEAT));
+}
+
+// Start monitoring the keyboard devices passed by systemd socket activation,
+// with ListenSpecial=, as part of the default seat. Return the number of fds
+// passed.
+int addListenedKeyboards(int epoll_fd) {
+  const char *pid = getenv("LISTEN_PID");
+  const char *fds = getenv("LISTEN_FDS");
+  if (pid == NULL || fds == NULL || atol(pid) != getpid()) {
+    return 0;
+  }
+  int n_fds = atoi(fds);
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + n_fds; fd++) {
+    dev_t devnum = evdevDevnum(fd);
+    if (devnum == 0) {
+      warn("Ignoring passed fd, not an input event device");
+      close(fd);
+      continue;
+    }
+    // The fds are opened blocking by systemd.
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+      warn("Error setting up passed keyboard fd");
+      close(fd);
+      continue;
+    }
+    addKeyboardFd(epoll_fd, fd, devnum, findSeat(DEFAULT_SEAT));
+  }
+  return n_fds;
+}
+
+// Queue the given keyboard to be read, if it is not already.
+void queueKeyboard(Keyboard *kbd) {
+  if (kbd->ready) {
+    return;
+  }
+  kbd->ready = 1;
+  kbd->next_ready = NULL;
+  if (last_ready_keyboard != NULL) {
+    last_ready_keyboard->next_ready = kbd;
+  } else {
+    ready_keyboards = kbd;
+  }
+  last_ready_keyboard = kbd;
+}
+
+// Remove the given keyboard from the queue of keyboards to be read.
+void unqueueKeyboard(Keyboard *kbd) {
+  Keyboard *prev = NULL;
+  for (Keyboard *k = ready_keyboards; k != kbd; k = k->next_ready) {
+    prev = k;
+  }
+  if (prev != NULL) {
+    prev->next_ready = kbd->next_ready;
+  } else {
+    ready_keyboards = kbd->next_ready;
+  }
+  if (last_ready_keyboard == kbd) {
+    last_ready_keyboard = prev;
+  }
+  kbd->ready = 0;
+}
+
+// Read and handle the events of the given keyboard, at most the given number
+// of reads. Return 1 if it may have events left, 0 if it has been drained or
+// removed.
+int readKeyboard(int epoll_fd, Keyboard *kbd, int budget) {
+  for (int i = 0; i < budget; i++) {
+    // Read all the pending events from the keyboard at once, up to the size
+    // of the buffer.
+    ssize_t n_bytes = read(kbd->source.fd, kbd->events, sizeof(kbd->events));
+    if (n_bytes < 0) {
+      if (errno == ENODEV) {
+        // The keyboard has been unplugged.
+        removeKeyboard(epoll_fd, kbd);
+      } else if (errno != EAGAIN) {
+        stats->read_errors++;
+        warn("Error reading events from keyboard device");
+      }
+      return 0;
+    }
+    handleEvents(kbd, kbd->events, n_bytes / sizeof(struct input_event));
+    if ((size_t)n_bytes < sizeof(kbd->events)) {
+      // A short read means that the keyboard has been drained.
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Read the keyboards with events left, each up to a budget of reads in turn,
+// so that one flooding keyboard cannot delay the others. Those which are not
+// drained yet go to the back of the queue. Return whether any is left.
+int readReadyKeyboards(int epoll_fd) {
+  Keyboard *last = last_ready_keyboard;
+  while (ready_keyboards != NULL) {
+    Keyboard *kbd = ready_keyboards;
+    unqueueKeyboard(kbd);
+    if (kbd->source.fd >= 0 &&
+        readKeyboard(epoll_fd, kbd, KEYBOARD_READ_BUDGET)) {
+      queueKeyboard(kbd);
+    }
+    // Every keyboard gets one turn per call.
+    if (kbd == last) {
+      break;
+    }
+  }
+  return ready_keyboards != NULL;
+}
+
+// Stop monitoring the given keyboard and close its file descriptor. The
+// keyboard is freed by freeClosedKeyboards().
+void removeKeyboard(int epoll_fd, Keyboard *kbd) {
+  // Don't leave the hold and chord keys of the keyboard pressed.
+  trace_device = kbd->index;
+  uinputSelect(kbd->seat);
+  resetChordState(kbd);
+  resetDualRoleState(&kbd->dual_role);
+
+  if (uring_fd >= 0) {
+    uringCancelRead(kbd);
+  } else if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, kbd->source.fd, NULL) < 0) {
+    warn("Error removing keyboard fd from epoll instance");
+  }
+  close(kbd->source.fd);
+  kbd->source.fd = -1;
+  if (kbd->ready) {
+    unqueueKeyboard(kbd);
+  }
+
+  // Keep the table compact by moving the last keyboard into the free slot.
+  Keyboard *last = keyboards[--n_keyboards];
+  keyboards[kbd->index] = last;
+  last->index = kbd->index;
+  stats->keyboards = n_keyboards;
+
+  kbd->next_closed = closed_keyboards;
+  closed_keyboards = kbd;
+}
+
+// Free the keyboards removed since the last call, except those whose io_uring
+// read has not completed yet.
+void freeClosedKeyboards(void) {
+  Keyboard **next = &closed_keyboards;
+  while (*next != NULL) {
+    Keyboard *kbd = *next;
+    // Completions of the read refer to the keyboard.
+    if (kbd->reading && uring_fd >= 0) {
+      next = &kbd->next_closed;
+      continue;
+    }
+    *next = kbd->next_closed;
+    free(kbd);
+  }
+}
+
+// Return a udev enumerate context listing the connected keyboard devices,
+// which the caller unrefs. Fails on error.
+struct udev_enumerate *enumerateKeyboards(struct udev *udev) {
+  // Get udev enumerate context.
+  struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+  if (enumerate == NULL) {
+    die("Error creating udev enumerate context");
+  }
+
+  // Filter to only input devices.
+  if (udev_enumerate_add_match_subsystem(enumerate, "input") < 0) {
+    die("Error adding 'input' subsystem match");
+  }
+  // Filter to only event devices, skipping the legacy mouse and joystick
+  // nodes of the subsystem.
+  if (udev_enumerate_add_match_sysname(enumerate, "event*") < 0) {
+    die("Error adding 'event*' sysname match");
+  }
+  // Filter to only keyboard devices.
+  if (udev_enumerate_add_match_property(enumerate, "ID_INPUT_KEYBOARD", "1") <
+      0) {
+    die("Error adding 'ID_INPUT_KEYBOARD=1' property match");
+  }
+
+  // Get the list of filtered devices. It is empty if no keyboard is
+  // connected yet, in which case we wait for one to be plugged in.
+  if (udev_enumerate_scan_devices(enumerate) < 0) {
+    die("Error scanning udev devices");
+  }
+  return enumerate;
+}
+
+// Open all the connected keyboard devices and add them to the epoll instance.
+// Fails on error.
+void addKeyboards(struct udev *udev, int epoll_fd) {
+  struct udev_enumerate *enumerate = enumerateKeyboards(udev);
+  struct udev_list_entry *devices = udev_enumerate_get_list_entry(enumerate);
+
+  // Iterate over the list of devices.
+  struct udev_list_entry *entry;
+  udev_list_entry_foreach(entry, devices) {
+    // Get device information.
+    const char *path = udev_list_entry_get_name(entry);
+    struct udev_device *device = udev_device_new_from_syspath(udev, path);
+    if (device == NULL) {
+      die("Error getting udev device");
+    }
+    addKeyboard(epoll_fd, device);
+    udev_device_unref(device);
+  }
+
+  // Clean up.
+  udev_enumerate_unref(enumerate);
+}
+
+// Create a udev monitor reporting input devices being added or removed, and
+// add its fd to the epoll instance through the given source. Fails on error.
+struct udev_monitor *addMonitor(struct udev *udev, int epoll_fd,
+                                Source *source) {
+  struct udev_monitor *monitor = udev_monitor_new_from_netlink(udev, "udev");
+  if (monitor == NULL) {
+    die("Error creating udev monitor");
+  }
+  if (udev_monitor_filter_add_match_subsystem_devtype(monitor, "input",
+                                                      NULL) < 0) {
+    die("Error adding 'input' subsystem filter to udev monitor");
+  }
+  if (udev_monitor_enable_receiving(monitor) < 0) {
+    die("Error enabling udev monitor");
+  }
+
+  source->type = SOURCE_MONITOR;
+  source->fd = udev_monitor_get_fd(monitor);
+  if (addSource(epoll_fd, source, EPOLLIN) < 0) {
+    die("Error adding udev monitor fd to epoll instance");
+  }
+  return monitor;
+}
+
+// Handle a udev monitor event, starting or stopping monitoring a keyboard when
+// it gets connected or disconnected.
+void handleMonitorEvent(int epoll_fd, struct udev_monitor *monitor) {
+  struct udev_device *device = udev_monitor_receive_device(monitor);
+  if (device == NULL) {
+    warn("Error receiving udev monitor event");
+    return;
+  }
+
+  const char *action = udev_device_get_action(device);
+  if (action != NULL) {
+    if (strcmp(action, "add") == 0) {
+      addKeyboard(epoll_fd, device);
+    } else if (strcmp(action, "remove") == 0) {
+      // The keyboard may already be gone if we noticed its removal first.
+      Keyboard *kbd = findKeyboard(udev_device_get_devnum(device));
+      if (kbd != NULL) {
+        removeKeyboard(epoll_fd, kbd);
+      }
+    }
+  }
+  udev_device_unref(device);
+}
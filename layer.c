@@ -0,0 +1,127 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Layers: tables of keys sent in place of the others, activated while holding
+// dual-role keys when grabbing.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "wlcape.h"
+
+// Built-in layouts, laid out at compile time so that they can be copied into a
+// layer as they are. Keys not listed are sent as themselves.
+const uint16_t nav_layout[KEY_CNT] = {
+    [KEY_H] = KEY_LEFT,
+    [KEY_J] = KEY_DOWN,
+    [KEY_K] = KEY_UP,
+    [KEY_L] = KEY_RIGHT,
+    [KEY_Y] = KEY_HOME,
+    [KEY_U] = KEY_PAGEDOWN,
+    [KEY_I] = KEY_PAGEUP,
+    [KEY_O] = KEY_END,
+    [KEY_N] = KEY_BACKSPACE,
+    [KEY_M] = KEY_DELETE,
+    [KEY_P] = KEY_INSERT,
+    [KEY_SEMICOLON] = KEY_ENTER,
+};
+const uint16_t numpad_layout[KEY_CNT] = {
+    [KEY_U] = KEY_7,
+    [KEY_I] = KEY_8,
+    [KEY_O] = KEY_9,
+    [KEY_J] = KEY_4,
+    [KEY_K] = KEY_5,
+    [KEY_L] = KEY_6,
+    [KEY_M] = KEY_1,
+    [KEY_COMMA] = KEY_2,
+    [KEY_DOT] = KEY_3,
+    [KEY_SPACE] = KEY_0,
+    [KEY_SEMICOLON] = KEY_MINUS,
+    [KEY_P] = KEY_EQUAL,
+};
+const struct {
+  const char *name;
+  const uint16_t *keys;
+} layouts[] = {
+    {"nav", nav_layout},
+    {"numpad", numpad_layout},
+};
+
+// Return the key to send for the given key event of a keyboard with the given
+// dual-role key state, looked up in the topmost of its active layers. Keys are
+// released as they were pressed, even if the layers changed since.
+int layerKey(DualRoleState *state, const struct input_event *ev) {
+  if (ev->value == DOWN) {
+    int layer = 31 - __builtin_clz(state->layers | 1);
+    state->layer_keys[ev->code] = config->layers[layer][ev->code];
+  }
+  int code = state->layer_keys[ev->code];
+  return code != 0 ? code : ev->code;
+}
+
+// Parse a layer number, from 1 to MAX_LAYERS - 1 if the base layer is
+// excluded. Return the layer, or -1 if invalid.
+int parseLayer(const char *name, int allow_base) {
+  char *end;
+  long layer = strtol(name, &end, 10);
+  if (*name == '\0' || *end != '\0' || layer < (allow_base ? 0 : 1) ||
+      layer >= MAX_LAYERS) {
+    return -1;
+  }
+  return layer;
+}
+
+// Add keys to a layer of the given configuration, given a mapping in the
+// LAYER:KEY:TARGET format, making KEY send TARGET on LAYER, or LAYER:LAYOUT to
+// copy one of the built-in layouts. Layer 0 is the base layer, always active.
+// Return 0 on success, -1 on error.
+int addLayerKey(Config *c, const char *mapping) {
+  char buffer[128];
+  if (strlen(mapping) >= sizeof(buffer)) {
+    return -1;
+  }
+  strcpy(buffer, mapping);
+
+  char *layer_name = strtok(buffer, ":");
+  char *key_name = strtok(NULL, ":");
+  char *target_name = strtok(NULL, ":");
+  if (layer_name == NULL || key_name == NULL || strtok(NULL, ":") != NULL) {
+    return -1;
+  }
+  int layer = parseLayer(layer_name, 1);
+  if (layer < 0) {
+    return -1;
+  }
+
+  if (target_name == NULL) {
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+      if (strcasecmp(key_name, layouts[i].name) == 0) {
+        memcpy(c->layers[layer], layouts[i].keys, sizeof(c->layers[layer]));
+        return 0;
+      }
+    }
+    return -1;
+  }
+  int key = parseKey(key_name);
+  int target = parseKey(target_name);
+  if (key < 0 || target < 0) {
+    return -1;
+  }
+  c->layers[layer][key] = target;
+  return 0;
+}
@@ -0,0 +1,674 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Remapping engine: dual-role keys and event handling.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Configuration given on the command line, active configuration, and the one
+// replacing it once no dual-role key or chord is in flight. The active
+// configuration is never modified: reloading it builds a new one.
+Config default_config = {.timeout_ms = 200, .chord_ms = 30};
+const Config *config = &default_config;
+Config *next_config = NULL;
+
+// Whether to grab the keyboards, forwarding all of their events through uinput.
+int grab = 0;
+
+// Timer firing when the earliest pending dual-role key of any keyboard turns
+// into a hold, or when the keys held back for a chord are no longer one.
+Source timer_source = {SOURCE_TIMER, -1};
+
+// Return the time at which the dual-role key in the given slot, if still
+// pending, turns into a hold, in microseconds.
+uint64_t holdDeadline(const DualRoleState *state, int slot) {
+  return timevalUs(&state->press_times[slot]) + tapTimeoutUs(state->adaptive);
+}
+
+// Arm the timer for the earliest deadline of the pending dual-role keys and of
+// the chords of all the keyboards, or disarm it if there are none. Only needed
+// when grabbing, as the hold keys are not sent otherwise.
+void armTimer(void) {
+  uint64_t earliest = UINT64_MAX;
+  for (size_t i = 0; i < n_keyboards; i++) {
+    ChordState *chord = &keyboards[i]->chord;
+    if (chord->candidates != 0 && chordDeadline(chord) < earliest) {
+      earliest = chordDeadline(chord);
+    }
+    chord->timer_armed = chord->candidates != 0;
+
+    DualRoleState *state = &keyboards[i]->dual_role;
+    for (uint32_t mask = state->pending; mask != 0; mask &= mask - 1) {
+      uint64_t deadline = holdDeadline(state, __builtin_ctz(mask));
+      if (deadline < earliest) {
+        earliest = deadline;
+      }
+    }
+    state->timer_pending = state->pending;
+  }
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (earliest != UINT64_MAX) {
+    spec.it_value.tv_sec = earliest / 1000000;
+    spec.it_value.tv_nsec = (earliest % 1000000) * 1000;
+  }
+  if (timerfd_settime(timer_source.fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    warn("Error arming hold timer");
+  }
+}
+
+// Handle again the events held back while a dual-role key of the given
+// keyboard was undecided, now that it has been resolved. They are copied out
+// first, as they may be held back again by another dual-role key among them.
+// Return 0 on success, -1 on error.
+int replayHeldBackEvents(DualRoleState *state) {
+  struct input_event events[MAX_HELD_BACK_EVENTS];
+  size_t n_events = state->n_held_back;
+  memcpy(events, state->held_back, n_events * sizeof(events[0]));
+  state->n_held_back = 0;
+
+  int ret = 0;
+  for (size_t i = 0; i < n_events; i++) {
+    if (handleEvent(state, &events[i]) < 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+// Resolve the pending dual-role key in the given slot as a hold, pressing its
+// hold key, then replay the events held back meanwhile. Return 0 on success,
+// -1 on error.
+int pressHoldKey(DualRoleState *state, const struct input_event *base_ev,
+                 int slot) {
+  const DualRoleKey *key = &config->dual_role_keys[slot];
+  state->pending &= ~(1U << slot);
+  state->held |= 1U << slot;
+  stats->holds++;
+  if (key->layer != 0) {
+    state->layers |= 1U << key->layer;
+  } else if (uinputQueueEvent(base_ev, key->hold, DOWN, DECISION_HOLD) < 0) {
+    return -1;
+  }
+  return replayHeldBackEvents(state);
+}
+
+// Return the mask of the layers activated by the held dual-role keys of the
+// given state.
+uint32_t heldLayers(const DualRoleState *state) {
+  uint32_t layers = 0;
+  for (uint32_t mask = state->held; mask != 0; mask &= mask - 1) {
+    uint16_t layer = config->dual_role_keys[__builtin_ctz(mask)].layer;
+    layers |= layer != 0 ? 1U << layer : 0;
+  }
+  return layers;
+}
+
+// Handle an event of the dual-role key in the given slot. Return 0 on success,
+// -1 on error.
+int handleDualRoleKey(DualRoleState *state, struct input_event *ev, int slot) {
+  const DualRoleKey *key = &config->dual_role_keys[slot];
+  uint32_t mask = 1U << slot;
+
+  if (ev->value == DOWN) {
+    // When grabbing, pressing the key again shortly after tapping it presses
+    // its tap key right away, so that it can be repeated.
+    if (grab && key->quick_tap_ms > 0 && timerisset(&state->tap_times[slot]) &&
+        timeBetween(&state->tap_times[slot], &ev->time) <
+            key->quick_tap_ms * 1000L) {
+      state->tapping |= mask;
+      stats->taps++;
+      if (uinputQueueEvent(ev, key->tap, DOWN, DECISION_QUICK_TAP) < 0) {
+        warn("Error while queueing dual-role key event");
+        return -1;
+      }
+      return 0;
+    }
+    // Remember the kernel timestamp of the press. When grabbing, the key is
+    // pending until it is either tapped or held.
+    state->press_times[slot] = ev->time;
+    state->pending |= mask;
+    state->solo |= mask;
+  } else if (ev->value == UP) {
+    int ret = 0;
+    if (state->pending & mask) {
+      state->pending &= ~mask;
+      // Check how long the key has been held down for.
+      long elapsed = timeBetween(&state->press_times[slot], &ev->time);
+      if (elapsed < tapTimeoutUs(state->adaptive)) {
+        // If the key was released within the timeout, simulate its tap key.
+        ret = uinputQueueTap(ev, key->tap, DECISION_TAP);
+        state->tap_times[slot] = ev->time;
+        stats->taps++;
+      } else if (grab) {
+        // The release was handled before the timer fired.
+        ret = key->layer != 0 ? 0
+                              : uinputQueueTap(ev, key->hold, DECISION_HOLD);
+        stats->holds++;
+      }
+      // The events pressed after the key follow its tap.
+      if (ret == 0 && state->n_held_back > 0) {
+        ret = replayHeldBackEvents(state);
+      }
+    } else if (state->held & mask) {
+      state->held &= ~mask;
+      if (key->layer != 0) {
+        state->layers = heldLayers(state);
+      } else {
+        ret = uinputQueueEvent(ev, key->hold, UP, DECISION_HOLD);
+      }
+    } else if (state->tapping & mask) {
+      state->tapping &= ~mask;
+      state->tap_times[slot] = ev->time;
+      ret = uinputQueueEvent(ev, key->tap, UP, DECISION_QUICK_TAP);
+    }
+    // Only learn once the key has been resolved with the current timeout.
+    if (state->solo & mask) {
+      state->solo &= ~mask;
+      adaptTimeout(state->adaptive,
+                   timeBetween(&state->press_times[slot], &ev->time));
+    }
+    if (ret < 0) {
+      warn("Error while queueing dual-role key event");
+      return -1;
+    }
+  } else if ((state->held & mask && key->layer == 0) ||
+             state->tapping & mask) {
+    // Autorepeat of the hold or tap key.
+    int held = state->held & mask;
+    if (uinputQueueEvent(ev, held ? key->hold : key->tap, ev->value,
+                         held ? DECISION_HOLD : DECISION_QUICK_TAP) < 0) {
+      warn("Error while queueing dual-role key event");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Press the hold key of the dual-role key that was pending for longer than
+// the timeout at the time of the given event, if any, and of those it was
+// holding back in turn. Return 0 on success, -1 on error.
+int pressExpiredHoldKeys(DualRoleState *state, const struct input_event *ev) {
+  uint64_t now = timevalUs(&ev->time);
+  while (state->pending != 0) {
+    int slot = __builtin_ctz(state->pending);
+    if (holdDeadline(state, slot) > now) {
+      break;
+    }
+    // The hold key comes from the press of the dual-role key, not from the
+    // event or the timer expiration noticing that it has been held, so that
+    // its latency covers the timeout.
+    struct input_event base_ev = *ev;
+    base_ev.time = state->press_times[slot];
+    if (pressHoldKey(state, &base_ev, slot) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Return whether the key released by the given event was pressed among the
+// held back events.
+int isHeldBackTap(const DualRoleState *state, const struct input_event *ev) {
+  for (size_t i = 0; i < state->n_held_back; i++) {
+    const struct input_event *held_back = &state->held_back[i];
+    if (held_back->type == EV_KEY && held_back->code == ev->code &&
+        held_back->value == DOWN) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// When grabbing, decide what to do with the given event while a dual-role key
+// is pending, according to the policy of that key. Other keys pressed
+// meanwhile, and the events following them, are held back until the key is
+// either tapped or held, which happens at most after the timeout. Return 1 if
+// the event was held back, 0 if it must be handled now, -1 on error.
+int holdBackEvent(DualRoleState *state, struct input_event *ev) {
+  int slot = __builtin_ctz(state->pending);
+  const DualRoleKey *key = &config->dual_role_keys[slot];
+  int is_key = ev->type == EV_KEY;
+
+  // The events of the key itself resolve it, and the other events go through
+  // until another key is pressed, like releases of keys pressed earlier.
+  if (is_key && ev->code == key->key) {
+    return 0;
+  }
+  if (state->n_held_back == 0 && !(is_key && ev->value == DOWN)) {
+    return 0;
+  }
+
+  // Pressing another key makes it a hold right away, as does filling up the
+  // held back events.
+  if (key->policy == POLICY_HOLD_ON_OTHER_KEY_PRESS ||
+      state->n_held_back == MAX_HELD_BACK_EVENTS) {
+    return pressHoldKey(state, ev, slot) < 0 ? -1 : 0;
+  }
+
+  state->held_back[state->n_held_back++] = *ev;
+  // Tapping another key while the key is down makes it a hold.
+  if (key->policy == POLICY_PERMISSIVE_HOLD && is_key && ev->value == UP &&
+      isHeldBackTap(state, ev) && pressHoldKey(state, ev, slot) < 0) {
+    return -1;
+  }
+  return 1;
+}
+
+// Return whether the press of the given key has been forwarded, and not its
+// release yet.
+int isForwardedKey(const DualRoleState *state, int code) {
+  return (state->forwarded[code / 64] >> (code % 64)) & 1;
+}
+
+// Remember whether the key of the given event, which is being forwarded, is
+// down.
+void trackForwardedKey(DualRoleState *state, const struct input_event *ev) {
+  uint64_t bit = 1ULL << (ev->code % 64);
+  if (ev->value == DOWN) {
+    state->forwarded[ev->code / 64] |= bit;
+  } else if (ev->value == UP) {
+    state->forwarded[ev->code / 64] &= ~bit;
+  }
+}
+
+// Queue a release of every key whose press has been forwarded, as it was
+// sent on the layers, and forget them. Return the number of releases queued.
+int releaseForwardedKeys(DualRoleState *state) {
+  struct input_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = EV_KEY;
+  int n_released = 0;
+  for (int i = 0; i < (KEY_CNT + 63) / 64; i++) {
+    for (uint64_t mask = state->forwarded[i]; mask != 0; mask &= mask - 1) {
+      int code = i * 64 + __builtin_ctzll(mask);
+      int sent = state->layer_keys[code] != 0 ? state->layer_keys[code] : code;
+      if (uinputQueueEvent(&ev, sent, UP, DECISION_RESET) < 0) {
+        warn("Error while queueing key release");
+      }
+      n_released++;
+    }
+  }
+  memset(state->forwarded, 0, sizeof(state->forwarded));
+  return n_released;
+}
+
+// Handle an event of a keyboard with the given dual-role key state. Return 0
+// on success, -1 on error.
+int handleEvent(DualRoleState *state, struct input_event *ev) {
+  // Pressing another key means that the dual-role keys down are not pressed
+  // alone, even if the key is held back.
+  if (state->solo != 0 && ev->type == EV_KEY && ev->value == DOWN &&
+      ev->code < KEY_CNT) {
+    int slot = config->dual_role_slots[ev->code] - 1;
+    state->solo &= slot >= 0 ? 1U << slot : 0;
+  }
+  if (grab && state->pending != 0) {
+    // The timer may not have fired yet for keys that were already held before
+    // this event happened, like when replaying recorded events.
+    if (pressExpiredHoldKeys(state, ev) < 0) {
+      warn("Error while queueing hold key press");
+      return -1;
+    }
+    int ret = state->pending != 0 ? holdBackEvent(state, ev) : 0;
+    if (ret != 0) {
+      if (ret < 0) {
+        warn("Error while queueing hold key press");
+      }
+      return ret < 0 ? -1 : 0;
+    }
+  }
+
+  if (ev->type == EV_KEY && ev->code < KEY_CNT) {
+    int slot = config->dual_role_slots[ev->code] - 1;
+    // A key whose press was forwarded is released the same way, even if a new
+    // configuration made it a dual-role key since.
+    if (ev->value != DOWN && isForwardedKey(state, ev->code)) {
+      slot = -1;
+    }
+
+    // If we press another key while a dual-role key is being held down, we
+    // don't want the dual-role key to be eligible for tap simulation. When
+    // grabbing, the policy of the key decides instead.
+    // Dual-role keys of other keyboards are not affected.
+    if (!grab) {
+      state->pending &= slot >= 0 ? 1U << slot : 0;
+    }
+    if (slot >= 0) {
+      return handleDualRoleKey(state, ev, slot);
+    }
+  }
+
+  // When grabbing, forward everything else as it is, other keys as they are on
+  // the active layers. Frames are terminated by the SYN_REPORTs coming from the
+  // keyboard, unless they would be empty.
+  if (grab) {
+    int ret = 0;
+    if (ev->type == EV_SYN) {
+      ret = ev->code == SYN_REPORT ? uinputQueueSync() : 0;
+    } else if (ev->type == EV_KEY && ev->code < KEY_CNT) {
+      struct input_event key_ev = *ev;
+      key_ev.code = layerKey(state, ev);
+      trackForwardedKey(state, ev);
+      ret = uinputQueue(&key_ev, key_ev.code != ev->code ? DECISION_LAYER
+                                                         : DECISION_FORWARD);
+    } else {
+      ret = uinputQueue(ev, DECISION_FORWARD);
+    }
+    if (ret < 0) {
+      warn("Error while queueing event");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Handle the expiration of the hold timer, resolving the chords that can no
+// longer be completed, and pressing the hold key of every dual-role key that
+// has been pending for longer than the timeout.
+void handleTimer(void) {
+  uint64_t expirations;
+  if (read(timer_source.fd, &expirations, sizeof(expirations)) < 0) {
+    return;
+  }
+  stats->timer_wakeups++;
+
+  uint64_t now = nowUs();
+  struct input_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = EV_KEY;
+  ev.time.tv_sec = now / 1000000;
+  ev.time.tv_usec = now % 1000000;
+
+  for (size_t i = 0; i < n_keyboards; i++) {
+    trace_device = i;
+    uinputSelect(keyboards[i]->seat);
+    if (expireChord(keyboards[i], &ev) < 0) {
+      warn("Error while queueing chord events");
+    }
+    DualRoleState *state = &keyboards[i]->dual_role;
+    if (state->pending != 0 && pressExpiredHoldKeys(state, &ev) < 0) {
+      warn("Error while queueing hold key press");
+    }
+  }
+  if (uinputFlush() < 0) {
+    warn("Error while writing events to uinput");
+  }
+  armTimer();
+}
+
+// Release the hold and quick tap keys of the given keyboard, which is being
+// removed, and the other keys still down, so that none stays stuck when it
+// goes away while typing, like through a KVM switch or a Bluetooth dropout.
+// Forget its pending dual-role keys, the events they held back and the layers
+// they activated.
+void resetDualRoleState(DualRoleState *state) {
+  int n_released = releaseForwardedKeys(state);
+  if (grab && (n_released > 0 || (state->held | state->tapping) != 0)) {
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EV_KEY;
+    for (uint32_t mask = state->held | state->tapping; mask != 0;
+         mask &= mask - 1) {
+      int slot = __builtin_ctz(mask);
+      const DualRoleKey *key = &config->dual_role_keys[slot];
+      int held = state->held & (1U << slot);
+      if (held && key->layer != 0) {
+        continue;
+      }
+      if (uinputQueueEvent(&ev, held ? key->hold : key->tap, UP,
+                           DECISION_RESET) < 0) {
+        warn("Error while queueing dual-role key event");
+      }
+    }
+    if (uinputFlush() < 0) {
+      warn("Error while writing events to uinput");
+    }
+  }
+  state->pending = 0;
+  state->held = 0;
+  state->tapping = 0;
+  state->solo = 0;
+  state->layers = 0;
+  state->n_held_back = 0;
+  if (grab && state->timer_pending != 0) {
+    armTimer();
+  }
+}
+
+// Handle a batch of events of the given keyboard, as returned by a single
+// read() on its device, then write the resulting events to uinput all at once.
+// Return 0 on success, -1 if any event failed.
+int handleEvents(Keyboard *kbd, struct input_event *events, size_t n_events) {
+  uint64_t read_us = measure_latency ? nowUs() : 0;
+
+  DualRoleState *state = &kbd->dual_role;
+  stats->events += n_events;
+  trace_device = kbd->index;
+  uinputSelect(kbd->seat);
+  int ret = 0;
+  for (size_t i = 0; i < n_events; i++) {
+    traceEvent(&events[i], TRACE_INPUT);
+    if (events[i].type == EV_KEY && events[i].value == DOWN) {
+      stats->presses++;
+    }
+    if (handleChordEvent(kbd, &events[i]) < 0) {
+      ret = -1;
+    }
+  }
+  uint64_t handle_us = measure_latency ? nowUs() : 0;
+
+  if (uinputFlush() < 0) {
+    warn("Error while writing events to uinput");
+    ret = -1;
+  }
+  if (grab && (state->pending != state->timer_pending ||
+               (kbd->chord.candidates != 0) != kbd->chord.timer_armed)) {
+    armTimer();
+  }
+  // Only the dual-role keys and the chords keep state across frames, the other
+  // keys being released as they were pressed, so a new configuration can be
+  // swapped in after any batch where none of them is in flight.
+  if (next_config != NULL) {
+    applyConfig();
+  }
+
+  // Record how long each stage took for the oldest event of the batch.
+  if (measure_latency && n_events > 0) {
+    uint64_t flush_us = nowUs();
+    uint64_t event_us = timevalUs(&events[0].time);
+    histogramRecord(&latencies[STAGE_WAKE], wake_time_us - event_us);
+    histogramRecord(&latencies[STAGE_READ], read_us - wake_time_us);
+    histogramRecord(&latencies[STAGE_HANDLE], handle_us - read_us);
+    histogramRecord(&latencies[STAGE_FLUSH], flush_us - handle_us);
+    histogramRecord(&latencies[STAGE_TOTAL], flush_us - event_us);
+  }
+  return ret;
+}
+
+// Names of the keys that can be used in mappings, besides numeric key codes.
+#define KEY_NAME(name) {#name, KEY_##name}
+const struct {
+  const char *name;
+  uint16_t code;
+} key_names[] = {
+    KEY_NAME(ESC),        KEY_NAME(1),          KEY_NAME(2),
+    KEY_NAME(3),          KEY_NAME(4),          KEY_NAME(5),
+    KEY_NAME(6),          KEY_NAME(7),          KEY_NAME(8),
+    KEY_NAME(9),          KEY_NAME(0),          KEY_NAME(MINUS),
+    KEY_NAME(EQUAL),      KEY_NAME(BACKSPACE),  KEY_NAME(TAB),
+    KEY_NAME(Q),          KEY_NAME(W),          KEY_NAME(E),
+    KEY_NAME(R),          KEY_NAME(T),          KEY_NAME(Y),
+    KEY_NAME(U),          KEY_NAME(I),          KEY_NAME(O),
+    KEY_NAME(P),          KEY_NAME(LEFTBRACE),  KEY_NAME(RIGHTBRACE),
+    KEY_NAME(ENTER),      KEY_NAME(LEFTCTRL),   KEY_NAME(A),
+    KEY_NAME(S),          KEY_NAME(D),          KEY_NAME(F),
+    KEY_NAME(G),          KEY_NAME(H),          KEY_NAME(J),
+    KEY_NAME(K),          KEY_NAME(L),          KEY_NAME(SEMICOLON),
+    KEY_NAME(APOSTROPHE), KEY_NAME(GRAVE),      KEY_NAME(LEFTSHIFT),
+    KEY_NAME(BACKSLASH),  KEY_NAME(Z),          KEY_NAME(X),
+    KEY_NAME(C),          KEY_NAME(V),          KEY_NAME(B),
+    KEY_NAME(N),          KEY_NAME(M),          KEY_NAME(COMMA),
+    KEY_NAME(DOT),        KEY_NAME(SLASH),      KEY_NAME(RIGHTSHIFT),
+    KEY_NAME(LEFTALT),    KEY_NAME(SPACE),      KEY_NAME(CAPSLOCK),
+    KEY_NAME(F1),         KEY_NAME(F2),         KEY_NAME(F3),
+    KEY_NAME(F4),         KEY_NAME(F5),         KEY_NAME(F6),
+    KEY_NAME(F7),         KEY_NAME(F8),         KEY_NAME(F9),
+    KEY_NAME(F10),        KEY_NAME(F11),        KEY_NAME(F12),
+    KEY_NAME(NUMLOCK),    KEY_NAME(SCROLLLOCK), KEY_NAME(RIGHTCTRL),
+    KEY_NAME(RIGHTALT),   KEY_NAME(HOME),       KEY_NAME(UP),
+    KEY_NAME(PAGEUP),     KEY_NAME(LEFT),       KEY_NAME(RIGHT),
+    KEY_NAME(END),        KEY_NAME(DOWN),       KEY_NAME(PAGEDOWN),
+    KEY_NAME(INSERT),     KEY_NAME(DELETE),     KEY_NAME(LEFTMETA),
+    KEY_NAME(RIGHTMETA),  KEY_NAME(COMPOSE),    KEY_NAME(SYSRQ),
+};
+
+// Parse a key name, such as "capslock" or "KEY_CAPSLOCK", or a numeric key
+// code. Return the key code, or -1 if invalid.
+int parseKey(const char *name) {
+  if (strncasecmp(name, "KEY_", 4) == 0) {
+    name += 4;
+  }
+  for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+    if (strcasecmp(name, key_names[i].name) == 0) {
+      return key_names[i].code;
+    }
+  }
+
+  char *end;
+  long code = strtol(name, &end, 0);
+  if (*name == '\0' || *end != '\0' || code <= KEY_RESERVED ||
+      code >= KEY_CNT) {
+    return -1;
+  }
+  return code;
+}
+
+// Names of the policies of dual-role keys.
+const char *policy_names[] = {
+    [POLICY_HOLD_ON_OTHER_KEY_PRESS] = "hold-on-other-key-press",
+    [POLICY_PERMISSIVE_HOLD] = "permissive-hold",
+    [POLICY_TAP_PREFERRED] = "tap-preferred",
+};
+
+// Parse a policy name. Return the policy, or -1 if invalid.
+int parsePolicy(const char *name) {
+  for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+    if (strcasecmp(name, policy_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Add a dual-role key to the table of the given configuration, given a mapping
+// in the KEY:TAP[:HOLD[:POLICY[:QUICK_TAP_MS]]] format. The key acts as itself
+// when held if HOLD is omitted, activates a layer instead if HOLD is "@LAYER",
+// and is resolved as a hold as soon as another key is pressed if POLICY is
+// omitted. Return 0 on success, -1 on error.
+int addDualRoleKey(Config *c, const char *mapping) {
+  char buffer[128];
+  if (strlen(mapping) >= sizeof(buffer)) {
+    return -1;
+  }
+  strcpy(buffer, mapping);
+
+  char *key_name = strtok(buffer, ":");
+  char *tap_name = strtok(NULL, ":");
+  char *hold_name = strtok(NULL, ":");
+  char *policy_name = strtok(NULL, ":");
+  char *quick_tap = strtok(NULL, ":");
+  if (key_name == NULL || tap_name == NULL || strtok(NULL, ":") != NULL) {
+    return -1;
+  }
+  int key = parseKey(key_name);
+  int tap = parseKey(tap_name);
+  int hold = hold_name != NULL ? parseKey(hold_name) : key;
+  int layer = 0;
+  if (hold_name != NULL && hold_name[0] == '@') {
+    layer = parseLayer(hold_name + 1, 0);
+    hold = key;
+  }
+  int policy = policy_name != NULL ? parsePolicy(policy_name)
+                                   : POLICY_HOLD_ON_OTHER_KEY_PRESS;
+  char *end = "";
+  long quick_tap_ms = quick_tap != NULL ? strtol(quick_tap, &end, 10) : 0;
+  if (key < 0 || tap < 0 || hold < 0 || layer < 0 || policy < 0 ||
+      *end != '\0' || quick_tap_ms < 0 || quick_tap_ms > 10000 ||
+      c->dual_role_slots[key] != 0 ||
+      c->n_dual_role_keys >= MAX_DUAL_ROLE_KEYS) {
+    return -1;
+  }
+
+  DualRoleKey *dual_role_key = &c->dual_role_keys[c->n_dual_role_keys];
+  dual_role_key->key = key;
+  dual_role_key->tap = tap;
+  dual_role_key->hold = hold;
+  dual_role_key->policy = policy;
+  dual_role_key->layer = layer;
+  dual_role_key->quick_tap_ms = quick_tap_ms;
+  c->dual_role_slots[key] = ++c->n_dual_role_keys;
+  return 0;
+}
+
+// Replace the active configuration with the given one, taking ownership of
+// it. The state of the dual-role keys and chords refers to the slots of the
+// active configuration, so it is only swapped in once none of them is in
+// flight.
+void replaceConfig(Config *c) {
+  free(next_config);
+  next_config = c;
+  applyConfig();
+}
+
+// Swap in the configuration waiting to replace the active one, if any and if
+// no dual-role key or chord of any keyboard is in flight. The times of the
+// last presses and taps are forgotten, as the new configuration may number the
+// dual-role keys differently. The other keys down are released as they were
+// pressed.
+void applyConfig(void) {
+  if (next_config == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < n_keyboards; i++) {
+    const DualRoleState *state = &keyboards[i]->dual_role;
+    const ChordState *chord = &keyboards[i]->chord;
+    if ((state->pending | state->held | state->tapping | state->solo) != 0 ||
+        (chord->candidates | chord->active) != 0) {
+      return;
+    }
+  }
+  for (size_t i = 0; i < n_keyboards; i++) {
+    DualRoleState *state = &keyboards[i]->dual_role;
+    memset(state->press_times, 0, sizeof(state->press_times));
+    memset(state->tap_times, 0, sizeof(state->tap_times));
+  }
+  if (config != &default_config) {
+    free((Config *)config);
+  }
+  config = next_config;
+  next_config = NULL;
+  reportTimeout();
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Privilege separation: a helper process keeps the privileges needed to open
+// the keyboards found through udev and the files the event loop needs later
+// on, and passes them over a Unix socket to the event loop, which runs as an
+// unprivileged user under a seccomp filter.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <libudev.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <linux/uinput.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// In the event loop, socket the helper passes the keyboards and the files over,
+// and whether the files are asked for to the helper, as they cannot be opened
+// once unprivileged. In the helper, socket to the event loop, or -1 in the
+// event loop.
+Source helper_source = {SOURCE_HELPER, -1};
+int files_from_helper = 0;
+int event_loop_fd = -1;
+
+// Send the given message, passing the given fds along, to the event loop.
+// Return 0 on success, -1 on error.
+int sendHelperMessage(const HelperMessage *message, const int *fds,
+                      int n_fds) {
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {(void *)message, sizeof(*message)};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = n_fds > 0 ? control.buffer : NULL,
+      .msg_controllen = n_fds > 0 ? CMSG_SPACE(n_fds * sizeof(int)) : 0,
+  };
+  if (n_fds > 0) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+  }
+  return sendmsg(event_loop_fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// Pass the keyboard open as the given fd, with the given device number and
+// seat, to the event loop, closing the fd. A seat other than the default one
+// may be new to the event loop, which cannot open /dev/uinput to create its
+// virtual keyboard, so an fd of it is passed along. Return 0 on success, -1 on
+// error.
+int sendKeyboard(int fd, dev_t devnum, const char *seat) {
+  HelperMessage message;
+  memset(&message, 0, sizeof(message));
+  message.kind = HELPER_KEYBOARD;
+  message.devnum = devnum;
+  if (strlen(seat) >= sizeof(message.seat)) {
+    warn("Keyboard seat name too long");
+    close(fd);
+    return -1;
+  }
+  strcpy(message.seat, seat);
+
+  int fds[2] = {fd, -1};
+  int n_fds = 1;
+  if (strcmp(seat, DEFAULT_SEAT) != 0) {
+    fds[1] = openUinput();
+    n_fds = fds[1] >= 0 ? 2 : 1;
+  }
+  int ret = sendHelperMessage(&message, fds, n_fds);
+  if (ret < 0) {
+    warn("Error passing keyboard to the event loop");
+  }
+  for (int i = 0; i < n_fds; i++) {
+    close(fds[i]);
+  }
+  return ret;
+}
+
+// Open the file the event loop asks for, and pass it back. Only the
+// configuration and trace files given on the command line can be asked for.
+// Return 0 on success, -1 if the event loop has exited.
+int handleFileRequest(void) {
+  HelperMessage message;
+  ssize_t n_bytes = recv(event_loop_fd, &message, sizeof(message), 0);
+  if (n_bytes <= 0) {
+    return n_bytes < 0 && errno == EINTR ? 0 : -1;
+  }
+  if ((size_t)n_bytes != sizeof(message)) {
+    return 0;
+  }
+  int fd = -1;
+  errno = EINVAL;
+  if (message.kind == HELPER_CONFIG && config_path != NULL) {
+    fd = open(config_path, O_RDONLY | O_CLOEXEC);
+  } else if (message.kind == HELPER_TRACE && trace_path != NULL) {
+    fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
+              0600);
+  }
+  message.error = fd < 0 ? errno : 0;
+  if (sendHelperMessage(&message, &fd, fd >= 0) < 0) {
+    warn("Error passing file to the event loop");
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return 0;
+}
+
+// Run the privileged helper, opening the files the event loop asks for over
+// the given socket and, if asked to, passing every keyboard found through
+// udev, and those plugged in later, to it, until the event loop exits. Never
+// returns.
+void runHelper(int sock, int monitor_keyboards) {
+  event_loop_fd = sock;
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    die("Error creating helper epoll instance");
+  }
+  Source event_loop_source = {SOURCE_HELPER, sock};
+  if (addSource(epoll_fd, &event_loop_source, EPOLLIN) < 0) {
+    die("Error adding event loop socket to epoll instance");
+  }
+
+  struct udev_monitor *monitor = NULL;
+  Source monitor_source;
+  if (monitor_keyboards) {
+    struct udev *udev = udev_new();
+    if (udev == NULL) {
+      die("Error creating udev context");
+    }
+    monitor = addMonitor(udev, epoll_fd, &monitor_source);
+    addKeyboards(udev, epoll_fd);
+  }
+
+  for (;;) {
+    struct epoll_event ev;
+    int n_events = epoll_wait(epoll_fd, &ev, 1, -1);
+    if (n_events < 0 && errno != EINTR) {
+      die("Error waiting for events on helper epoll instance");
+    }
+    if (n_events <= 0) {
+      continue;
+    }
+    Source *source = ev.data.ptr;
+    if (source->type == SOURCE_MONITOR) {
+      handleMonitorEvent(epoll_fd, monitor);
+      continue;
+    }
+    // The event loop asks for a file, or has exited.
+    if (!(ev.events & EPOLLIN) || handleFileRequest() < 0) {
+      _exit(0);
+    }
+  }
+}
+
+// Start the privileged helper in a child process, which opens the files the
+// event loop asks for and, if asked to, the keyboards, and watch the socket it
+// passes them over from the given epoll instance. Fails on error.
+void startHelper(int epoll_fd, int monitor_keyboards) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+    die("Error creating helper socket");
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    die("Error starting helper");
+  }
+  if (pid == 0) {
+    // Only keep the socket, right after the standard streams, as the helper
+    // must not hold on to the virtual keyboards and the other resources of the
+    // event loop, and let it be stopped along with the daemon.
+    int sock = STDERR_FILENO + 1;
+    if (dup2(fds[1], sock) < 0) {
+      _exit(1);
+    }
+    closefrom(sock + 1);
+    sigset_t signals;
+    sigfillset(&signals);
+    sigprocmask(SIG_UNBLOCK, &signals, NULL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    runHelper(sock, monitor_keyboards);
+  }
+  close(fds[1]);
+  helper_source.fd = fds[0];
+  files_from_helper = 1;
+  if (addSource(epoll_fd, &helper_source, EPOLLIN) < 0) {
+    die("Error adding helper socket to epoll instance");
+  }
+}
+
+// Ask the privileged helper for the file of the given kind, which is handled
+// once passed back. Return 0 on success, -1 on error.
+int requestHelperFile(HelperKind kind) {
+  HelperMessage message;
+  memset(&message, 0, sizeof(message));
+  message.kind = kind;
+  if (helper_source.fd < 0 ||
+      send(helper_source.fd, &message, sizeof(message),
+           MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+    warn("Error asking the privileged helper for a file");
+    return -1;
+  }
+  return 0;
+}
+
+// Use the file of the kind of the given message, passed back by the privileged
+// helper as the given fd, or -1 if it could not be opened.
+void handleHelperFile(const HelperMessage *message, int fd) {
+  const char *path = message->kind == HELPER_CONFIG ? config_path : trace_path;
+  if (fd < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(message->error));
+    if (message->kind == HELPER_CONFIG) {
+      warn("Keeping the current configuration");
+    }
+    return;
+  }
+  if (message->kind == HELPER_CONFIG) {
+    reloadConfig(fd);
+  } else if (dumpTraceFd(fd) < 0) {
+    warn("Error dumping trace");
+  }
+}
+
+// Receive a keyboard passed by the privileged helper, and start monitoring it,
+// or a file the event loop asked for.
+void handleHelperMessage(int epoll_fd) {
+  HelperMessage message;
+  int fds[2] = {-1, -1};
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(fds))];
+  } control;
+  struct iovec iov = {&message, sizeof(message)};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+  };
+  ssize_t n_bytes =
+      recvmsg(helper_source.fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  if (n_bytes <= 0) {
+    if (n_bytes == 0 || errno != EAGAIN) {
+      // Keep going with the keyboards we have.
+      warn("Privileged helper exited, not opening new keyboards nor files");
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, helper_source.fd, NULL);
+      close(helper_source.fd);
+      helper_source.fd = -1;
+    }
+    return;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), (n_fds < 2 ? n_fds : 2) * sizeof(int));
+  }
+  if ((size_t)n_bytes != sizeof(message) || message.kind > HELPER_TRACE ||
+      (message.kind == HELPER_KEYBOARD &&
+       (fds[0] < 0 ||
+        memchr(message.seat, '\0', sizeof(message.seat)) == NULL))) {
+    warn("Invalid message from privileged helper");
+    for (int i = 0; i < 2; i++) {
+      if (fds[i] >= 0) {
+        close(fds[i]);
+      }
+    }
+    return;
+  }
+  if (message.kind != HELPER_KEYBOARD) {
+    if (fds[1] >= 0) {
+      close(fds[1]);
+    }
+    handleHelperFile(&message, fds[0]);
+    return;
+  }
+
+  // A device can be both enumerated and reported by the monitor at startup.
+  if (findKeyboard(message.devnum) != NULL) {
+    close(fds[0]);
+    if (fds[1] >= 0) {
+      close(fds[1]);
+    }
+    return;
+  }
+  // The virtual keyboard of a new seat can only be created on the fd of
+  // /dev/uinput passed along.
+  Seat *seat = findSeat(message.seat);
+  if (seat == NULL && fds[1] >= 0) {
+    seat = addSeat(epoll_fd, message.seat, fds[1]);
+  } else if (fds[1] >= 0) {
+    close(fds[1]);
+  }
+  if (seat == NULL) {
+    warn("Error adding keyboard seat");
+    close(fds[0]);
+    return;
+  }
+  addKeyboardFd(epoll_fd, fds[0], message.devnum, seat);
+}
+
+// Switch to the given user and its group, for good, without any way to gain
+// privileges back. Return 0 on success, -1 on error.
+int dropPrivileges(const char *user) {
+  struct passwd *pw = getpwnam(user);
+  if (pw == NULL) {
+    return -1;
+  }
+  if (setgroups(0, NULL) < 0 || setgid(pw->pw_gid) < 0 ||
+      setuid(pw->pw_uid) < 0) {
+    return -1;
+  }
+  if (pw->pw_uid != 0 && setuid(0) == 0) {
+    return -1;
+  }
+  return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+}
+
+// Architecture of the syscall numbers the seccomp filter allows.
+#if defined(__x86_64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#endif
+
+// Jump over the next instruction for any other syscall, which allows it.
+#define ALLOW_SYSCALL(name)                                \
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_##name, 0, 1), \
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+// Same for the request of an ioctl, loaded beforehand. Requests are 32 bits,
+// the low half of the argument on these little-endian architectures.
+#define ALLOW_IOCTL(request)                              \
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (request), 0, 1), \
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+// Restrict the process to the syscalls of the event loop, and of reloading
+// the configuration and dumping the trace, killing it on any other. No file
+// can be opened: keyboards, /dev/uinput for new seats and the configuration
+// and trace files are all opened by the helper. The ioctls are restricted to
+// those setting up the keyboards and the virtual keyboards, and the others
+// fail with ENOTTY, as the C library may probe whether a stream is a terminal.
+// The io_uring instance, which the filter does not apply to, restricts its own
+// operations. Return 0 on success, -1 on error.
+int installSeccomp(void) {
+#ifdef SECCOMP_AUDIT_ARCH
+  struct sock_filter filter[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+#ifdef __X32_SYSCALL_BIT
+      BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+#endif
+      // The event loop.
+      ALLOW_SYSCALL(epoll_pwait),
+#ifdef __NR_epoll_wait
+      ALLOW_SYSCALL(epoll_wait),
+#endif
+      ALLOW_SYSCALL(epoll_ctl),
+      ALLOW_SYSCALL(read),
+      ALLOW_SYSCALL(write),
+      ALLOW_SYSCALL(recvmsg),
+      ALLOW_SYSCALL(sendto),
+      ALLOW_SYSCALL(timerfd_settime),
+      ALLOW_SYSCALL(clock_gettime),
+      ALLOW_SYSCALL(io_uring_enter),
+      ALLOW_SYSCALL(fcntl),
+      ALLOW_SYSCALL(close),
+      // Memory allocation, for keyboards and configurations.
+      ALLOW_SYSCALL(brk),
+      ALLOW_SYSCALL(mmap),
+      ALLOW_SYSCALL(munmap),
+      ALLOW_SYSCALL(mremap),
+      ALLOW_SYSCALL(madvise),
+      // Reading the configuration file, and writing the trace.
+      ALLOW_SYSCALL(newfstatat),
+      ALLOW_SYSCALL(fstat),
+      ALLOW_SYSCALL(lseek),
+      ALLOW_SYSCALL(writev),
+      // Exiting.
+      ALLOW_SYSCALL(rt_sigreturn),
+      ALLOW_SYSCALL(rt_sigprocmask),
+      ALLOW_SYSCALL(exit_group),
+      ALLOW_SYSCALL(exit),
+      // Setting up the keyboards and the virtual keyboards.
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_ioctl, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+               offsetof(struct seccomp_data, args[1])),
+      ALLOW_IOCTL(EVIOCGRAB),
+      ALLOW_IOCTL(EVIOCSCLOCKID),
+      ALLOW_IOCTL(EVIOCSMASK),
+      ALLOW_IOCTL(UI_SET_EVBIT),
+      ALLOW_IOCTL(UI_SET_KEYBIT),
+      ALLOW_IOCTL(UI_SET_RELBIT),
+      ALLOW_IOCTL(UI_SET_LEDBIT),
+      ALLOW_IOCTL(UI_SET_PHYS),
+      ALLOW_IOCTL(UI_DEV_SETUP),
+      ALLOW_IOCTL(UI_DEV_CREATE),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOTTY),
+  };
+  struct sock_fprog program = {
+      .len = sizeof(filter) / sizeof(filter[0]),
+      .filter = filter,
+  };
+  return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program, 0, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Counters of the event loop, optionally published in a shared memory file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Counters, which live in the shared memory file once published. They are
+// only written by the event loop, with plain increments.
+Stats local_stats;
+Stats *stats = &local_stats;
+
+// Names of the counters, printed in this order.
+#define STAT(name) {#name, offsetof(Stats, name)}
+const struct {
+  const char *name;
+  size_t offset;
+} stat_fields[] = {
+    STAT(events),       STAT(taps),         STAT(holds),
+    STAT(read_errors),  STAT(write_eagain), STAT(write_errors),
+    STAT(keyboards),    STAT(write_dropped), STAT(timeout_us),
+    STAT(wakeups),      STAT(timer_wakeups), STAT(presses),
+};
+
+// Map the shared memory file at the given path, creating it if needed, and
+// move the counters into it, so that metrics agents can read them with mmap()
+// instead of asking the daemon. The file should be on a tmpfs like /dev/shm or
+// /run, which never needs writing back. Return 0 on success, -1 on error.
+int publishStats(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(Stats)) < 0) {
+    close(fd);
+    return -1;
+  }
+  // Fault the page in now, so that counting never does.
+  Stats *shared = mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (shared == MAP_FAILED) {
+    return -1;
+  }
+  *shared = *stats;
+  memcpy(shared->magic, STATS_MAGIC, sizeof(shared->magic));
+  shared->version = STATS_VERSION;
+  stats = shared;
+  return 0;
+}
+
+// Print the given counters, one "NAME VALUE" line each.
+void printStats(const Stats *s) {
+  for (size_t i = 0; i < sizeof(stat_fields) / sizeof(stat_fields[0]); i++) {
+    uint64_t value;
+    memcpy(&value, (const char *)s + stat_fields[i].offset, sizeof(value));
+    printf("%s %llu\n", stat_fields[i].name, (unsigned long long)value);
+  }
+}
+
+// Map the counters published by a running daemon in the shared memory file at
+// the given path, read-only, to be unmapped with munmap(). Counters the daemon
+// does not know about yet read as 0. Return them, or NULL on error.
+const Stats *mapStatsFile(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("Error opening statistics file");
+    return NULL;
+  }
+  Stats *shared = mmap(NULL, sizeof(Stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shared == MAP_FAILED) {
+    perror("Error mapping statistics file");
+    return NULL;
+  }
+  if (memcmp(shared->magic, STATS_MAGIC, sizeof(shared->magic)) != 0 ||
+      shared->version != STATS_VERSION) {
+    fprintf(stderr, "Unsupported statistics file\n");
+    munmap(shared, sizeof(Stats));
+    return NULL;
+  }
+  return shared;
+}
+
+// Print the counters published by a running daemon in the shared memory file
+// at the given path. Return 0 on success, -1 on error.
+int printStatsFile(const char *path) {
+  const Stats *shared = mapStatsFile(path);
+  if (shared == NULL) {
+    return -1;
+  }
+  printStats(shared);
+  munmap((void *)shared, sizeof(Stats));
+  return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Trace of the last input and output events, dumped on demand as a trace file
+// the benchmark can replay.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Ring of the last events, total number of events traced, and index of the
+// keyboard whose events are being handled.
+TraceRecord trace_ring[TRACE_RING_SIZE];
+uint64_t n_traced = 0;
+int trace_device = 0;
+
+// File the trace is dumped to, or NULL.
+const char *trace_path = NULL;
+
+// Number of events traced when the output events were last written.
+uint64_t n_injected = 0;
+
+// Record an event in the trace, as a record of the given kind and decision.
+void traceEvent(const struct input_event *ev, int flags) {
+  TraceRecord *record = &trace_ring[n_traced++ & (TRACE_RING_SIZE - 1)];
+  record->ev = *ev;
+  record->device = trace_device;
+  record->flags = flags;
+  record->delay_us = 0;
+}
+
+// Stamp the output events traced since the last call, which are being written
+// to uinput, with the time since their source event, and record it as their
+// injection latency. Only called when measuring latencies.
+void traceInjection(void) {
+  uint64_t now_us = nowUs();
+  uint64_t start = n_traced - n_injected > TRACE_RING_SIZE
+                       ? n_traced - TRACE_RING_SIZE
+                       : n_injected;
+  n_injected = n_traced;
+  for (uint64_t i = start; i < n_traced; i++) {
+    TraceRecord *record = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+    // SYN_REPORTs have no source event, and neither have the releases sent
+    // when a keyboard is removed, which are left unstamped.
+    if ((record->flags & 0xff) != TRACE_OUTPUT || record->ev.type == EV_SYN ||
+        !timerisset(&record->ev.time)) {
+      continue;
+    }
+    int64_t delay_us = now_us - timevalUs(&record->ev.time);
+    histogramRecord(&latencies[STAGE_INJECT], delay_us);
+    if (delay_us < 0) {
+      delay_us = 0;
+    }
+    record->delay_us = delay_us < UINT32_MAX ? delay_us : UINT32_MAX;
+  }
+}
+
+// Write the trace to the given fd, oldest events first, and close it. Return 0
+// on success, -1 on error.
+int dumpTraceFd(int fd) {
+  TraceHeader header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  size_t start = n_traced > TRACE_RING_SIZE ? n_traced % TRACE_RING_SIZE : 0;
+  size_t n_records = n_traced > TRACE_RING_SIZE ? TRACE_RING_SIZE : n_traced;
+  struct iovec iov[3] = {
+      {&header, sizeof(header)},
+      {&trace_ring[start], (n_records - start) * sizeof(TraceRecord)},
+      {trace_ring, start * sizeof(TraceRecord)},
+  };
+  size_t size = sizeof(header) + n_records * sizeof(TraceRecord);
+
+  int ret = writev(fd, iov, 3) == (ssize_t)size ? 0 : -1;
+  if (close(fd) < 0) {
+    ret = -1;
+  }
+  return ret;
+}
+
+// Write the trace to the given path, as dumpTraceFd() does. Return 0 on
+// success, -1 on error.
+int dumpTrace(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
+                0600);
+  if (fd < 0) {
+    return -1;
+  }
+  return dumpTraceFd(fd);
+}
@@ -0,0 +1,489 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Virtual keyboard: uinput device creation and output buffering.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Seats, each with its own virtual keyboard, and seat the queued events are
+// written to.
+Seat **seats = NULL;
+size_t n_seats = 0;
+Seat *output_seat = NULL;
+
+// Events waiting to be written to uinput, flushed once per batch of input.
+struct input_event output_events[MAX_OUTPUT_EVENTS];
+size_t n_output_events = 0;
+
+// Epoll instance the virtual keyboards are added to, watched for LED events
+// when grabbing and for room to write while they have a backlog.
+int uinput_epoll_fd = -1;
+
+// Watch the virtual keyboard of the given seat for the given epoll events,
+// adding or removing it from the epoll instance as needed. Return 0 on
+// success, -1 on error.
+int uinputWatch(Seat *seat, uint32_t events) {
+  if (uinput_epoll_fd < 0 || events == seat->watched) {
+    return 0;
+  }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = &seat->source;
+  int op = EPOLL_CTL_MOD;
+  if (seat->watched == 0) {
+    op = EPOLL_CTL_ADD;
+  } else if (events == 0) {
+    op = EPOLL_CTL_DEL;
+  }
+  if (epoll_ctl(uinput_epoll_fd, op, seat->source.fd, &ev) < 0) {
+    return -1;
+  }
+  seat->watched = events;
+  return 0;
+}
+
+// Return the seat with the given udev name, or NULL if it has no virtual
+// keyboard yet.
+Seat *findSeat(const char *name) {
+  for (size_t i = 0; i < n_seats; i++) {
+    if (strcmp(seats[i]->name, name) == 0) {
+      return seats[i];
+    }
+  }
+  return NULL;
+}
+
+// Return the seat with the given udev name, creating its virtual keyboard and
+// adding it to the given epoll instance, if any, the first time. The virtual
+// keyboard is created on /dev/uinput open as the given fd, which is taken
+// ownership of, or -1 to open it. Seats are kept until exit, so that their
+// virtual keyboards stay the same when their keyboards are plugged again.
+// Return NULL on error.
+Seat *addSeat(int epoll_fd, const char *name, int uinput_fd) {
+  Seat *seat = findSeat(name);
+  if (seat != NULL) {
+    if (uinput_fd >= 0) {
+      close(uinput_fd);
+    }
+    return seat;
+  }
+  if (strlen(name) >= sizeof(seat->name)) {
+    return NULL;
+  }
+  Seat **new_seats = realloc(seats, (n_seats + 1) * sizeof(Seat *));
+  if (new_seats == NULL) {
+    return NULL;
+  }
+  seats = new_seats;
+  seat = calloc(1, sizeof(Seat));
+  if (seat == NULL) {
+    return NULL;
+  }
+  strcpy(seat->name, name);
+  bindAdaptiveState(seat);
+  seat->source.type = SOURCE_UINPUT;
+  seat->source.fd = createUinput(seat, uinput_fd);
+  if (epoll_fd >= 0) {
+    uinput_epoll_fd = epoll_fd;
+  }
+  if (uinputWatch(seat, grab ? EPOLLIN : 0) < 0) {
+    close(seat->source.fd);
+    free(seat);
+    return NULL;
+  }
+  seats[n_seats++] = seat;
+  if (output_seat == NULL) {
+    output_seat = seat;
+  }
+  return seat;
+}
+
+// Destroy the virtual keyboards of all the seats.
+void removeSeats(void) {
+  uinputFlush();
+  for (size_t i = 0; i < n_seats; i++) {
+    close(seats[i]->source.fd);
+    free(seats[i]);
+  }
+  free(seats);
+  seats = NULL;
+  n_seats = 0;
+  output_seat = NULL;
+}
+
+// Write the events queued from now on to the virtual keyboard of the given
+// seat, flushing those queued for another one first.
+void uinputSelect(Seat *seat) {
+  if (seat == output_seat) {
+    return;
+  }
+  if (uinputFlush() < 0) {
+    warn("Error while writing events to uinput");
+  }
+  output_seat = seat;
+}
+
+// Return whether the given event, following the given previous one kept, if
+// any, must reach uinput even when it falls too far behind: the release of a
+// key that was pressed would otherwise leave it stuck, whereas releasing a key
+// that is not pressed does nothing. SYN_REPORTs are kept to end the frames of
+// the releases.
+int isKeptEvent(const struct input_event *ev, const struct input_event *prev) {
+  if (ev->type == EV_SYN) {
+    return prev != NULL && prev->type != EV_SYN;
+  }
+  return ev->type == EV_KEY && ev->value == UP;
+}
+
+// Make room for the given events in the full backlog of the given seat by
+// dropping all but the key releases and SYN_REPORTs, both in the backlog and
+// among the events, then insert what is left of them at the given position.
+// Return the number of events inserted, or -1 if there is still no room.
+int uinputBacklogReleases(Seat *seat, size_t at,
+                          const struct input_event *events, size_t n_events) {
+  stats->write_dropped++;
+  size_t n_kept = 0;
+  size_t kept_at = 0;
+  size_t n_failed = 0;
+  for (size_t i = 0; i < seat->n_backlog; i++) {
+    if (!isKeptEvent(&seat->backlog[i],
+                     n_kept > 0 ? &seat->backlog[n_kept - 1] : NULL)) {
+      continue;
+    }
+    kept_at += i < at;
+    n_failed += i < seat->n_failed;
+    seat->backlog[n_kept++] = seat->backlog[i];
+  }
+  seat->n_backlog = n_kept;
+  seat->n_failed = n_failed;
+
+  // Only the SYN_REPORTs ending a release are kept, including across the
+  // position where the events go.
+  const struct input_event *prev = kept_at > 0 ? &seat->backlog[kept_at - 1]
+                                               : NULL;
+  size_t n_releases = 0;
+  for (size_t i = 0; i < n_events; i++) {
+    if (isKeptEvent(&events[i], prev)) {
+      prev = &events[i];
+      n_releases++;
+    }
+  }
+  if (seat->n_backlog + n_releases > MAX_BACKLOG_EVENTS) {
+    return -1;
+  }
+  memmove(&seat->backlog[kept_at + n_releases], &seat->backlog[kept_at],
+          (seat->n_backlog - kept_at) * sizeof(*seat->backlog));
+  prev = kept_at > 0 ? &seat->backlog[kept_at - 1] : NULL;
+  for (size_t i = 0, j = kept_at; i < n_events; i++) {
+    if (isKeptEvent(&events[i], prev)) {
+      prev = &events[i];
+      seat->backlog[j++] = events[i];
+    }
+  }
+  seat->n_backlog += n_releases;
+  return n_releases;
+}
+
+// Insert the given events in the backlog of the given seat, at the given
+// position. Output is deferred a whole batch at a time, so that a tap is never
+// split. If the backlog is full, the key presses are dropped, but the releases
+// are kept. Return the number of events inserted, or -1 on error.
+int uinputBacklog(Seat *seat, size_t at, const struct input_event *events,
+                  size_t n_events) {
+  if (seat->n_backlog + n_events > MAX_BACKLOG_EVENTS) {
+    return uinputBacklogReleases(seat, at, events, n_events);
+  }
+  memmove(&seat->backlog[at + n_events], &seat->backlog[at],
+          (seat->n_backlog - at) * sizeof(*seat->backlog));
+  memcpy(&seat->backlog[at], events, n_events * sizeof(*events));
+  seat->n_backlog += n_events;
+  return n_events;
+}
+
+// Queue the given events after the backlog of the given seat, to be written
+// once its virtual keyboard is writable again. Return 0 on success, -1 on
+// error.
+int uinputDefer(Seat *seat, const struct input_event *events,
+                size_t n_events) {
+  if (uinputBacklog(seat, seat->n_backlog, events, n_events) < 0) {
+    return -1;
+  }
+  if (uinputWatch(seat, EPOLLOUT | (grab ? EPOLLIN : 0)) < 0) {
+    warn("Error watching uinput for writing");
+  }
+  return 0;
+}
+
+// Queue the given events, which the virtual keyboard of the given seat could
+// not take from a write of io_uring, after those of the writes that failed
+// before it, but ahead of those queued after it. Return 0 on success, -1 on
+// error.
+int uinputRetry(Seat *seat, const struct input_event *events,
+                size_t n_events) {
+  int n_inserted = uinputBacklog(seat, seat->n_failed, events, n_events);
+  if (n_inserted < 0) {
+    return -1;
+  }
+  seat->n_failed += n_inserted;
+  if (uinputWatch(seat, EPOLLOUT | (grab ? EPOLLIN : 0)) < 0) {
+    warn("Error watching uinput for writing");
+  }
+  return 0;
+}
+
+// Remove the given number of events, which have been written, from the front
+// of the backlog of the given seat.
+void uinputConsume(Seat *seat, size_t n_events) {
+  seat->n_backlog -= n_events;
+  seat->n_failed = seat->n_failed > n_events ? seat->n_failed - n_events : 0;
+  memmove(seat->backlog, &seat->backlog[n_events],
+          seat->n_backlog * sizeof(*seat->backlog));
+  if (seat->n_backlog == 0 && uinputWatch(seat, grab ? EPOLLIN : 0) < 0) {
+    warn("Error watching uinput for writing");
+  }
+}
+
+// Write as much of the backlog of the given seat as its virtual keyboard
+// takes, when it is writable again.
+void uinputDrain(Seat *seat) {
+  // With io_uring, the backlog must not overtake the writes in flight.
+  if (uring_fd >= 0) {
+    uringDrain(seat);
+    return;
+  }
+  ssize_t n_bytes = write(seat->source.fd, seat->backlog,
+                          seat->n_backlog * sizeof(*seat->backlog));
+  if (n_bytes < 0) {
+    countWriteError(errno);
+    if (errno == EAGAIN) {
+      return;
+    }
+    // Don't retry forever.
+    warn("Error while writing events to uinput");
+    stats->write_dropped++;
+    n_bytes = seat->n_backlog * sizeof(*seat->backlog);
+  }
+  uinputConsume(seat, n_bytes / sizeof(*seat->backlog));
+}
+
+// Write the given events to the virtual keyboard of the given seat, deferring
+// those it cannot take yet. Return 0 on success, -1 on error.
+int uinputWrite(Seat *seat, const struct input_event *events,
+                size_t n_events) {
+  if (seat->n_backlog > 0) {
+    return uinputDefer(seat, events, n_events);
+  }
+  ssize_t n_bytes = write(seat->source.fd, events, n_events * sizeof(*events));
+  if (n_bytes < 0) {
+    countWriteError(errno);
+    return errno == EAGAIN ? uinputDefer(seat, events, n_events) : -1;
+  }
+  size_t n_written = n_bytes / sizeof(*events);
+  if (n_written < n_events) {
+    return uinputDefer(seat, &events[n_written], n_events - n_written);
+  }
+  return 0;
+}
+
+// Count a failed write to uinput, with the given error number.
+void countWriteError(int error) {
+  if (error == EAGAIN) {
+    stats->write_eagain++;
+  } else {
+    stats->write_errors++;
+  }
+}
+
+// Write all the queued events to the virtual keyboard of the selected seat
+// with a single syscall, as uinput accepts any number of events per write.
+// With io_uring, the write is only queued, and submitted along with the wait
+// for the next events. Events are deferred if uinput cannot take them yet.
+// Return 0 on success, -1 on error.
+int uinputFlush(void) {
+  if (n_output_events == 0) {
+    return 0;
+  }
+  size_t n_events = n_output_events;
+  n_output_events = 0;
+  if (measure_latency) {
+    traceInjection();
+  }
+
+  Seat *seat = output_seat;
+  if (uring_fd >= 0) {
+    return uringWrite(seat, output_events,
+                      n_events * sizeof(struct input_event));
+  }
+  return uinputWrite(seat, output_events, n_events);
+}
+
+// Make room for the given number of events in the output buffer, flushing it
+// early if needed. Return 0 on success, -1 on error.
+int uinputReserve(size_t n) {
+  if (n_output_events + n > MAX_OUTPUT_EVENTS) {
+    return uinputFlush();
+  }
+  return 0;
+}
+
+// Queue an event for uinput as it is, tracing it along with the given
+// decision. Return 0 on success, -1 on error.
+int uinputQueue(const struct input_event *ev, int decision) {
+  if (uinputReserve(1) < 0) {
+    return -1;
+  }
+  traceEvent(ev, TRACE_FLAGS(TRACE_OUTPUT, decision));
+  output_events[n_output_events++] = *ev;
+  output_seat->frame_open = ev->type != EV_SYN;
+  return 0;
+}
+
+// Queue a SYN_REPORT, terminating the frame of events queued so far for the
+// selected seat, if any.
+// Return 0 on success, -1 on error.
+int uinputQueueSync(void) {
+  if (!output_seat->frame_open) {
+    return 0;
+  }
+  struct input_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = EV_SYN;
+  ev.code = SYN_REPORT;
+  ev.value = 0;
+
+  return uinputQueue(&ev, DECISION_FORWARD);
+}
+
+// Queue a key event for uinput, followed by a SYN_REPORT. Press and release of
+// the same key are kept in separate frames, as consumers may collapse them
+// otherwise. Return 0 on success, -1 on error.
+int uinputQueueEvent(const struct input_event *base_ev, int code, int value,
+                     int decision) {
+  struct input_event ev = *base_ev;
+  ev.code = code;
+  ev.value = value;
+
+  if (uinputQueue(&ev, decision) < 0) {
+    return -1;
+  }
+  return uinputQueueSync();
+}
+
+// Queue a press and release of the given key, which are always written to
+// uinput together. Return 0 on success, -1 on error.
+int uinputQueueTap(const struct input_event *base_ev, int code, int decision) {
+  if (uinputReserve(4) < 0) {
+    return -1;
+  }
+  if (uinputQueueEvent(base_ev, code, DOWN, decision) < 0) {
+    return -1;
+  }
+  return uinputQueueEvent(base_ev, code, UP, decision);
+}
+
+// Open /dev/uinput. When grabbing, LED events sent to the virtual keyboard are
+// read back to be forwarded to the real ones. Return the fd, or -1 on error.
+int openUinput(void) {
+  return open("/dev/uinput",
+              (grab ? O_RDWR : O_WRONLY) | O_NONBLOCK | O_CLOEXEC);
+}
+
+// Create the uinput virtual keyboard of the given seat on /dev/uinput open as
+// the given fd, or -1 to open it, returning its file descriptor. Fails on
+// error.
+int createUinput(Seat *seat, int fd) {
+  if (fd < 0) {
+    fd = openUinput();
+  }
+  if (fd < 0) {
+    die("Error opening uinput");
+  }
+
+  // We are going to be generating EV_KEY events.
+  if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0) {
+    die("Error setting EV_KEY on uinput's EVBIT");
+  }
+  // We are going to forward every key of the grabbed keyboards when grabbing,
+  // as remapped by the layers, and otherwise any key can be a tap key after
+  // the configuration changes. Buttons are only forwarded when grabbing, and
+  // would otherwise make the virtual keyboard look like a mouse or a joystick.
+  for (int code = KEY_ESC; code < KEY_CNT; code++) {
+    if (!grab && code >= BTN_MISC && code <= BTN_GEAR_UP) {
+      continue;
+    }
+    if (ioctl(fd, UI_SET_KEYBIT, code) < 0) {
+      die("Error setting uinput's KEYBIT");
+    }
+  }
+  if (grab) {
+    // We are going to forward the motion of the mice that also register as
+    // keyboards.
+    if (ioctl(fd, UI_SET_EVBIT, EV_REL) < 0) {
+      die("Error setting EV_REL on uinput's EVBIT");
+    }
+    for (int code = 0; code < REL_CNT; code++) {
+      if (ioctl(fd, UI_SET_RELBIT, code) < 0) {
+        die("Error setting uinput's RELBIT");
+      }
+    }
+    // Make the keyboard LEDs controllable through the virtual keyboard.
+    if (ioctl(fd, UI_SET_EVBIT, EV_LED) < 0) {
+      die("Error setting EV_LED on uinput's EVBIT");
+    }
+    for (int code = 0; code < LED_CNT; code++) {
+      if (ioctl(fd, UI_SET_LEDBIT, code) < 0) {
+        die("Error setting uinput's LEDBIT");
+      }
+    }
+  }
+
+  // Tell the virtual keyboards of the seats apart, so that udev rules can
+  // assign them to their seat, and so that we never monitor them: when
+  // grabbing, they look just like real keyboards.
+  char phys[64];
+  snprintf(phys, sizeof(phys), "%s%s", UINPUT_PHYS_PREFIX, seat->name);
+  if (ioctl(fd, UI_SET_PHYS, phys) < 0) {
+    die("Error setting uinput device physical path");
+  }
+
+  // Define a virtual keyboard device.
+  struct uinput_setup usetup;
+  memset(&usetup, 0, sizeof(usetup));
+  usetup.id.bustype = BUS_USB;
+  usetup.id.vendor = 0x0001;
+  usetup.id.product = 0x0001;
+  strcpy(usetup.name, "wlcape");
+
+  // Setup and create uinput virtual keyboard device.
+  if (ioctl(fd, UI_DEV_SETUP, &usetup) < 0) {
+    die("Error setting up uinput device");
+  }
+  if (ioctl(fd, UI_DEV_CREATE) < 0) {
+    die("Error creating uinput device");
+  }
+  return fd;
+}
@@ -0,0 +1,448 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// io_uring event backend: multishot reads posted on every keyboard, and writes
+// to uinput submitted along with the wait for the next events, so that a press
+// to injection cycle takes about one io_uring_enter() call.
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Opcode of multishot reads (Linux 6.7), missing from older kernel headers.
+#define OP_READ_MULTISHOT 49
+
+// Tags of the completions which are not keyboard reads. Reads are tagged with
+// the address of their keyboard instead.
+#define TAG_EPOLL 1
+#define TAG_CANCEL 2
+#define TAG_WRITE 16  // Plus the index of the write buffer.
+
+// File descriptor of the io_uring instance, or -1 when using epoll only, and
+// epoll instance watching the other sources.
+int uring_fd = -1;
+int uring_epoll_fd = -1;
+
+// Submission queue shared with the kernel, local tail, number of entries
+// queued since the last submission and last write queued in that batch.
+unsigned *sq_head;
+unsigned *sq_tail;
+unsigned sq_mask;
+unsigned sq_entries;
+struct io_uring_sqe *sqes;
+unsigned sq_local_tail = 0;
+unsigned n_queued = 0;
+struct io_uring_sqe *last_write = NULL;
+
+// Completion queue shared with the kernel.
+unsigned *cq_head;
+unsigned *cq_tail;
+unsigned cq_mask;
+struct io_uring_cqe *cqes;
+
+// Buffers the kernel picks from for keyboard reads, and ring providing them.
+struct input_event read_buffers[URING_READ_BUFFERS][MAX_EVENTS_PER_READ];
+struct io_uring_buf_ring *buffer_ring;
+
+// Copies of the uinput output, owned by the kernel until their write
+// completes, with the seats they are written to, and mask of the free ones.
+struct input_event write_buffers[URING_WRITE_BUFFERS][MAX_OUTPUT_EVENTS];
+size_t write_sizes[URING_WRITE_BUFFERS];
+Seat *write_seats[URING_WRITE_BUFFERS];
+uint32_t free_write_buffers;
+
+// Number of writes queued since the last submission, linked to each other.
+unsigned n_linked_writes = 0;
+
+// Submit the queued operations and wait for at least the given number of
+// completions. Fails on error.
+void uringSubmit(unsigned min_complete) {
+  __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  int n;
+  do {
+    n = syscall(__NR_io_uring_enter, uring_fd, n_queued, min_complete, flags,
+                NULL, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    die("Error submitting to io_uring");
+  }
+  n_queued -= n;
+  last_write = NULL;
+  n_linked_writes = 0;
+}
+
+// Return whether the submission queue is full.
+int uringSqFull(void) {
+  return sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+         sq_entries;
+}
+
+// Return a cleared submission queue entry, submitting the queued ones first if
+// the queue is full.
+struct io_uring_sqe *uringGetSqe(void) {
+  if (uringSqFull()) {
+    uringSubmit(0);
+  }
+  struct io_uring_sqe *sqe = &sqes[sq_local_tail++ & sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  n_queued++;
+  return sqe;
+}
+
+// Give a read buffer back to the kernel.
+void uringReturnBuffer(unsigned id) {
+  uint16_t tail = buffer_ring->tail;
+  struct io_uring_buf *buf =
+      &buffer_ring->bufs[tail & (URING_READ_BUFFERS - 1)];
+  buf->addr = (uintptr_t)read_buffers[id];
+  buf->len = sizeof(read_buffers[id]);
+  buf->bid = id;
+  __atomic_store_n(&buffer_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Queue a poll of the epoll instance watching the other sources. It is queued
+// again every time it completes, once the caller has drained the instance.
+void uringPollEpoll(void) {
+  struct io_uring_sqe *sqe = uringGetSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = uring_epoll_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = TAG_EPOLL;
+}
+
+// Operations submitted to the io_uring instance, the only ones it allows.
+const uint8_t uring_ops[] = {
+    OP_READ_MULTISHOT,
+    IORING_OP_WRITE,
+    IORING_OP_POLL_ADD,
+    IORING_OP_ASYNC_CANCEL,
+};
+
+// Return whether the kernel supports all the operations we need.
+int uringSupported(int fd) {
+  size_t n_ops = 256;
+  struct io_uring_probe *probe =
+      calloc(1, sizeof(*probe) + n_ops * sizeof(struct io_uring_probe_op));
+  if (probe == NULL) {
+    return 0;
+  }
+  int supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                          probe, n_ops) == 0;
+  for (size_t i = 0; supported && i < sizeof(uring_ops); i++) {
+    supported = uring_ops[i] <= probe->last_op &&
+                probe->ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED;
+  }
+  free(probe);
+  return supported;
+}
+
+// Set up the io_uring instance, polling the given epoll instance for the
+// sources other than keyboards. Return 0 on success, -1 if io_uring or one of
+// the needed operations is not supported, in which case epoll is used
+// instead. Fails on other errors.
+int uringSetup(int epoll_fd) {
+  // Completions are only needed when waiting for them, and only this thread
+  // submits operations, once the ring is restricted to them.
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+                 IORING_SETUP_R_DISABLED;
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) {
+    return -1;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uringSupported(fd)) {
+    close(fd);
+    return -1;
+  }
+
+  // Map the submission and completion rings, which share a single mapping.
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+  char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) {
+    die("Error mapping io_uring rings");
+  }
+  sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+              IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    die("Error mapping io_uring submission entries");
+  }
+  sq_head = (unsigned *)(ring + params.sq_off.head);
+  sq_tail = (unsigned *)(ring + params.sq_off.tail);
+  sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+  sq_entries = params.sq_entries;
+  sq_local_tail = *sq_tail;
+  cq_head = (unsigned *)(ring + params.cq_off.head);
+  cq_tail = (unsigned *)(ring + params.cq_off.tail);
+  cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+  // Submission entries are always used in order.
+  unsigned *array = (unsigned *)(ring + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries; i++) {
+    array[i] = i;
+  }
+
+  // Provide the read buffers.
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (posix_memalign((void **)&buffer_ring, page_size,
+                     URING_READ_BUFFERS * sizeof(struct io_uring_buf)) != 0) {
+    die("Error allocating io_uring buffer ring");
+  }
+  memset(buffer_ring, 0, URING_READ_BUFFERS * sizeof(struct io_uring_buf));
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)buffer_ring;
+  reg.ring_entries = URING_READ_BUFFERS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0) {
+    die("Error registering io_uring buffer ring");
+  }
+
+  // Only allow our operations, with the flags they are submitted with, as the
+  // seccomp filter of the event loop does not apply to those of io_uring.
+  struct io_uring_restriction restrictions[sizeof(uring_ops) + 1];
+  memset(restrictions, 0, sizeof(restrictions));
+  for (size_t i = 0; i < sizeof(uring_ops); i++) {
+    restrictions[i].opcode = IORING_RESTRICTION_SQE_OP;
+    restrictions[i].sqe_op = uring_ops[i];
+  }
+  restrictions[sizeof(uring_ops)].opcode =
+      IORING_RESTRICTION_SQE_FLAGS_ALLOWED;
+  restrictions[sizeof(uring_ops)].sqe_flags =
+      IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+  unsigned n_restrictions = sizeof(restrictions) / sizeof(restrictions[0]);
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_RESTRICTIONS,
+              restrictions, n_restrictions) < 0 ||
+      syscall(__NR_io_uring_register, fd, IORING_REGISTER_ENABLE_RINGS, NULL,
+              0) < 0) {
+    die("Error restricting io_uring operations");
+  }
+  uring_fd = fd;
+  for (unsigned i = 0; i < URING_READ_BUFFERS; i++) {
+    uringReturnBuffer(i);
+  }
+  free_write_buffers = UINT32_MAX >> (32 - URING_WRITE_BUFFERS);
+
+  uring_epoll_fd = epoll_fd;
+  uringPollEpoll();
+  return 0;
+}
+
+// Close the io_uring instance, cancelling all its operations.
+void uringClose(void) {
+  if (uring_fd >= 0) {
+    close(uring_fd);
+    uring_fd = -1;
+  }
+}
+
+// Post a multishot read on the given keyboard, which stays posted until the
+// keyboard is removed.
+void uringReadKeyboard(Keyboard *kbd) {
+  struct io_uring_sqe *sqe = uringGetSqe();
+  sqe->opcode = OP_READ_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->fd = kbd->source.fd;
+  sqe->buf_group = 0;
+  sqe->user_data = (uintptr_t)kbd;
+  kbd->reading = 1;
+}
+
+// Cancel the read posted on the given keyboard. The keyboard must not be freed
+// until the read has completed.
+void uringCancelRead(Keyboard *kbd) {
+  if (!kbd->reading) {
+    return;
+  }
+  struct io_uring_sqe *sqe = uringGetSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uintptr_t)kbd;
+  sqe->user_data = TAG_CANCEL;
+}
+
+// Queue a write of the given events to the virtual keyboard of the given seat
+// from a free write buffer, linked to the previous one so that they are
+// performed in order.
+void uringQueueWrite(Seat *seat, const struct input_event *events,
+                     size_t n_bytes) {
+  int id = __builtin_ctz(free_write_buffers);
+  free_write_buffers &= ~(1u << id);
+  memcpy(write_buffers[id], events, n_bytes);
+  write_sizes[id] = n_bytes;
+  write_seats[id] = seat;
+
+  struct io_uring_sqe *sqe = uringGetSqe();
+  if (last_write != NULL) {
+    last_write->flags |= IOSQE_IO_LINK;
+  }
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = seat->source.fd;
+  sqe->addr = (uintptr_t)write_buffers[id];
+  sqe->len = n_bytes;
+  sqe->user_data = TAG_WRITE + id;
+  last_write = sqe;
+  n_linked_writes++;
+}
+
+// Return whether a write can be queued now, in order with the writes in
+// flight: only if they are all linked to it, as a chain of writes can still be
+// in progress after its submission, and a new one would overtake it.
+int uringCanWrite(void) {
+  unsigned n_writes =
+      URING_WRITE_BUFFERS - __builtin_popcount(free_write_buffers);
+  return free_write_buffers != 0 && n_writes == n_linked_writes &&
+         !uringSqFull();
+}
+
+// Write the given events to the virtual keyboard of the given seat, through
+// io_uring. While the seat has a backlog, or the write cannot be queued in
+// order, they are added to the backlog instead, to be written once the writes
+// in flight complete or uinput is writable again, rather than synchronously
+// ahead of them. Return 0 on success, -1 on error.
+int uringWrite(Seat *seat, const struct input_event *events, size_t n_bytes) {
+  if (seat->n_backlog > 0 || !uringCanWrite()) {
+    size_t n_events = n_bytes / sizeof(*events);
+    return uinputBacklog(seat, seat->n_backlog, events, n_events) < 0 ? -1 : 0;
+  }
+  uringQueueWrite(seat, events, n_bytes);
+  return 0;
+}
+
+// Queue writes of the backlog of the given seat, as long as they can be queued
+// in order.
+void uringDrain(Seat *seat) {
+  while (seat->n_backlog > 0 && uringCanWrite()) {
+    size_t n_events = seat->n_backlog < MAX_OUTPUT_EVENTS ? seat->n_backlog
+                                                          : MAX_OUTPUT_EVENTS;
+    uringQueueWrite(seat, seat->backlog, n_events * sizeof(*seat->backlog));
+    uinputConsume(seat, n_events);
+  }
+}
+
+// Handle the completion of a write from the given write buffer. Events that
+// uinput could not take, including those of the writes linked after a failed
+// one, are deferred until it is writable again.
+void uringHandleWrite(int id, int res) {
+  free_write_buffers |= 1u << id;
+  size_t n_events = write_sizes[id] / sizeof(struct input_event);
+  size_t n_written = res > 0 ? res / sizeof(struct input_event) : 0;
+  if (res < 0 && res != -ECANCELED) {
+    countWriteError(-res);
+  }
+  if (res < 0 && res != -EAGAIN && res != -ECANCELED) {
+    warn("Error while writing events to uinput");
+  } else if (n_written < n_events &&
+             uinputRetry(write_seats[id], &write_buffers[id][n_written],
+                         n_events - n_written) < 0) {
+    warn("Error while writing events to uinput");
+  }
+}
+
+// Handle the completion of a read posted on the given keyboard.
+void uringHandleRead(Keyboard *kbd, const struct io_uring_cqe *cqe) {
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0 && kbd->source.fd >= 0) {
+      handleEvents(kbd, read_buffers[id],
+                   cqe->res / sizeof(struct input_event));
+    }
+    uringReturnBuffer(id);
+  }
+  if (cqe->flags & IORING_CQE_F_MORE) {
+    return;
+  }
+
+  // The read is over: the keyboard has been removed, or the read has to be
+  // posted again.
+  kbd->reading = 0;
+  if (kbd->source.fd < 0) {
+    return;
+  }
+  if (cqe->res == -ENODEV) {
+    // The keyboard has been unplugged.
+    removeKeyboard(uring_epoll_fd, kbd);
+    return;
+  }
+  // Reads also stop when running out of buffers, which have been returned by
+  // now.
+  if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+    stats->read_errors++;
+    warn("Error reading events from keyboard device");
+  }
+  uringReadKeyboard(kbd);
+}
+
+// Submit the queued operations, wait for at least one to complete, and handle
+// the completions. Return 1 if the epoll instance has events ready, 0
+// otherwise.
+int uringWait(void) {
+  // Each write of a chain is only started once the previous one completes,
+  // while waiting, so wait for all the writes in flight, which never block,
+  // not to come back for each of them.
+  unsigned n_writes =
+      URING_WRITE_BUFFERS - __builtin_popcount(free_write_buffers);
+  uringSubmit(n_writes > 0 ? n_writes : 1);
+  stats->wakeups++;
+  if (measure_latency) {
+    wake_time_us = nowUs();
+  }
+
+  int epoll_ready = 0;
+  unsigned head = *cq_head;
+  while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = cqes[head & cq_mask];
+    __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+
+    if (cqe.user_data == TAG_EPOLL) {
+      epoll_ready = 1;
+      uringPollEpoll();
+    } else if (cqe.user_data >= TAG_WRITE &&
+               cqe.user_data < TAG_WRITE + URING_WRITE_BUFFERS) {
+      uringHandleWrite(cqe.user_data - TAG_WRITE, cqe.res);
+    } else if (cqe.user_data != TAG_CANCEL) {
+      uringHandleRead((Keyboard *)(uintptr_t)cqe.user_data, &cqe);
+    }
+  }
+
+  // Write the backlogs kept behind the writes that completed, unless uinput
+  // could not take them.
+  for (size_t i = 0; i < n_seats; i++) {
+    Seat *seat = seats[i];
+    if (seat->n_backlog > 0 && !(seat->watched & EPOLLOUT)) {
+      if (uringSqFull()) {
+        uringSubmit(0);
+      }
+      uringDrain(seat);
+    }
+  }
+  return epoll_ready;
+}
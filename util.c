@@ -0,0 +1,129 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Error handling, logging and time helpers.
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wlcape.h"
+
+// Error handling.
+void die(const char *msg) {
+  if (errno) {
+    perror(msg);
+  } else {
+    fprintf(stderr, "%s\n", msg);
+  }
+  exit(1);
+}
+
+// Logging function.
+void warn(const char *msg) { fprintf(stderr, "%s\n", msg); }
+
+// Return microseconds elapsed between the two given times.
+long timeBetween(const struct timeval *start, const struct timeval *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000 +
+         (end->tv_usec - start->tv_usec);
+}
+
+// Return the current time of the monotonic clock, in microseconds.
+uint64_t nowUs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// Return the given time in microseconds.
+uint64_t timevalUs(const struct timeval *t) {
+  return t->tv_sec * 1000000ULL + t->tv_usec;
+}
+
+// Add the given source to the epoll instance, watching for the given events.
+// Return 0 on success, -1 on error.
+int addSource(int epoll_fd, Source *source, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = source;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &ev);
+}
+
+// Parse a realtime scheduling policy of the form POLICY[:PRIORITY], where
+// POLICY is "fifo" or "rr". Return 0 on success, -1 on error.
+int parseScheduler(const char *spec, int *policy, int *priority) {
+  const char *colon = strchr(spec, ':');
+  size_t length = colon ? (size_t)(colon - spec) : strlen(spec);
+  if (length == 4 && strncasecmp(spec, "fifo", length) == 0) {
+    *policy = SCHED_FIFO;
+  } else if (length == 2 && strncasecmp(spec, "rr", length) == 0) {
+    *policy = SCHED_RR;
+  } else {
+    return -1;
+  }
+
+  *priority = DEFAULT_REALTIME_PRIORITY;
+  if (colon) {
+    char *end;
+    long value = strtol(colon + 1, &end, 10);
+    if (colon[1] == '\0' || *end != '\0' ||
+        value < sched_get_priority_min(*policy) ||
+        value > sched_get_priority_max(*policy)) {
+      return -1;
+    }
+    *priority = value;
+  }
+  return 0;
+}
+
+// Touch the stack, so that its pages are mapped and locked before the event
+// loop needs them.
+void prefaultStack(void) {
+  char stack[PREFAULT_STACK_SIZE];
+  volatile char *page = stack;
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < sizeof(stack); i += page_size) {
+    page[i] = 0;
+  }
+}
+
+// Switch to the given realtime scheduling policy and lock all the memory of
+// the daemon, so that the event loop neither waits behind other processes nor
+// takes page faults. Call after setup, once the buffers are allocated. Fails
+// on error.
+void enableRealtime(int policy, int priority) {
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  if (sched_setscheduler(0, policy, &param) < 0) {
+    die("Error setting realtime scheduling policy");
+  }
+
+  // Locking the current pages also faults in the buffers allocated so far,
+  // and later allocations, like the buffers of hotplugged keyboards, are
+  // faulted in and locked as soon as they are mapped.
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    die("Error locking memory");
+  }
+  prefaultStack();
+}
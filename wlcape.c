@@ -15,206 +15,274 @@
  */
 
 #include <errno.h>
-#include <fcntl.h>
 #include <libudev.h>
-#include <linux/uinput.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <sys/epoll.h>
-#include <sys/time.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
-// Maximum number of supported keyboards.
-#define MAX_KEYBOARDS 16
+#include "wlcape.h"
 
-// State of a key.
-typedef enum {
-  UP = 0,
-  DOWN = 1,
-} PressedState;
-
-PressedState capslock_state = UP;    // Pressed state of CAPSLOCK.
-struct timeval capslock_press_time;  // Time when CAPSLOCK was pressed.
-
-// If CAPSLOCK is released within this timeout, send ESC instead.
-int timeout_ms = 200;
-
-// Error handling.
-void die(const char *msg) {
-  if (errno) {
-    perror(msg);
-  } else {
-    fprintf(stderr, "%s\n", msg);
+// Handle a signal, returning 0 if the daemon should terminate, 1 otherwise.
+int handleSignal(int signal_fd) {
+  struct signalfd_siginfo info;
+  if (read(signal_fd, &info, sizeof(info)) < 0) {
+    return 1;
   }
-  exit(1);
-}
-
-// Logging function.
-void warn(const char *msg) { fprintf(stderr, "%s\n", msg); }
-
-// Return milliseconds elapsed since the given time, or -1 on error.
-long timeSince(struct timeval *t) {
-  struct timeval now;
-  if (gettimeofday(&now, NULL) < 0) {
-    return -1;
+  if (info.ssi_signo == SIGUSR1) {
+    if (measure_latency) {
+      dumpLatencies();
+    }
+    return 1;
   }
-  return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_usec - t->tv_usec) / 1000;
-}
-
-// Force uinput synchronization. Return 0 on success, -1 on error.
-int forceSync(int uinput_fd) {
-  struct input_event ev;
-
-  memset(&ev, 0, sizeof(ev));
-  ev.type = EV_SYN;
-  ev.code = SYN_REPORT;
-  ev.value = 0;
-
-  if (write(uinput_fd, &ev, sizeof(ev)) < 0) {
-    return -1;
+  if (info.ssi_signo == SIGUSR2) {
+    if (trace_path == NULL) {
+      warn("No trace file given");
+    } else if (files_from_helper) {
+      // The trace is dumped once the helper passes the file back.
+      requestHelperFile(HELPER_TRACE);
+    } else if (dumpTrace(trace_path) < 0) {
+      warn("Error dumping trace");
+    }
+    return 1;
   }
   return 0;
 }
 
-// Synchronously write a key event to uinput. Return 0 on success, -1 on error.
-int uinputWriteEvent(int uinput_fd, struct input_event *base_ev, int code,
-                     int value) {
-  struct input_event ev = *base_ev;
-  ev.code = code;
-  ev.value = value;
-
-  if (write(uinput_fd, &ev, sizeof(struct input_event)) < 0) {
-    return -1;
+// Wait for events on the epoll instance, for at most the given timeout in
+// milliseconds, and handle them. Return 0 if the daemon should terminate, 1
+// otherwise.
+int handleSources(int epoll_fd, struct udev_monitor *monitor, int timeout) {
+  struct epoll_event epoll_events[MAX_EPOLL_EVENTS];
+  int n_events = epoll_wait(epoll_fd, epoll_events, MAX_EPOLL_EVENTS, timeout);
+  if (n_events < 0) {
+    die("Error waiting for events on epoll instance");
   }
-
-  return forceSync(uinput_fd);
-}
-
-// Open all keyboard devices for reading, returning the respective file
-// descriptors via the fds parameter, and the number of connected keyboards
-// via the return value. Fails on error.
-int getKeyboardsFds(int *fds) {
-  // Get udev context.
-  struct udev *udev = udev_new();
-  if (udev == NULL) {
-    die("Error creating udev context");
-  }
-  // Get udev enumerate context.
-  struct udev_enumerate *enumerate = udev_enumerate_new(udev);
-  if (enumerate == NULL) {
-    die("Error creating udev enumerate context");
-  }
-
-  // Filter to only input devices.
-  if (udev_enumerate_add_match_subsystem(enumerate, "input") < 0) {
-    die("Error adding 'input' subsystem match");
-  }
-  // Filter to only keyboard devices.
-  if (udev_enumerate_add_match_property(enumerate, "ID_INPUT_KEYBOARD", "1") <
-      0) {
-    die("Error adding 'ID_INPUT_KEYBOARD=1' property match");
-  }
-
-  // Get the list of filtered devices.
-  if (udev_enumerate_scan_devices(enumerate) < 0) {
-    die("Error scanning udev devices");
-  }
-  struct udev_list_entry *devices = udev_enumerate_get_list_entry(enumerate);
-  if (devices == NULL) {
-    die("Error getting udev device list");
+  // Only count the waits that could sleep, not the polls in between reads.
+  if (timeout != 0) {
+    stats->wakeups++;
+    if (measure_latency) {
+      wake_time_us = nowUs();
+    }
   }
 
-  // Iterate over the list of devices.
-  int i = 0;
-  struct udev_list_entry *entry;
-  udev_list_entry_foreach(entry, devices) {
-    // Get device information.
-    const char *path = udev_list_entry_get_name(entry);
-    struct udev_device *device = udev_device_new_from_syspath(udev, path);
-    if (device == NULL) {
-      die("Error getting udev device");
+  int running = 1;
+  for (int i = 0; i < n_events; i++) {
+    Source *source = epoll_events[i].data.ptr;
+    if (source->type == SOURCE_MONITOR) {
+      // A device has been connected or disconnected.
+      handleMonitorEvent(epoll_fd, monitor);
+      continue;
     }
-
-    // Get the devnode path associated with the device.
-    const char *devnode = udev_device_get_devnode(device);
-    if (devnode != NULL) {
-      // Ensure we don't overflow the fds array.
-      if (i >= MAX_KEYBOARDS) {
-        warn("Too many keyboards, ignoring the rest");
-        break;
+    if (source->type == SOURCE_HELPER) {
+      // The privileged helper opened a keyboard for us.
+      handleHelperMessage(epoll_fd);
+      continue;
+    }
+    if (source->type == SOURCE_UINPUT) {
+      // uinput can take the events it could not before.
+      Seat *seat = (Seat *)source;
+      if (epoll_events[i].events & EPOLLOUT) {
+        uinputDrain(seat);
       }
-      // Open the keyboard device for reading.
-      fds[i] = open(devnode, O_RDONLY);
-      if (fds[i] < 0) {
-        die("Error opening keyboard device");
+      // The keyboard LEDs of the seat have changed.
+      if (epoll_events[i].events & EPOLLIN) {
+        handleUinputEvents(seat);
       }
-      i++;
+      continue;
+    }
+    if (source->type == SOURCE_TIMER) {
+      // A pending dual-role key is being held.
+      handleTimer();
+      continue;
+    }
+    if (source->type == SOURCE_CONFIG) {
+      // The configuration file may have changed.
+      handleConfigEvents();
+      continue;
+    }
+    if (source->type == SOURCE_SIGNAL) {
+      running = handleSignal(source->fd);
+      continue;
     }
-    udev_device_unref(device);
-  }
-
-  // Clean up.
-  udev_enumerate_unref(enumerate);
-  udev_unref(udev);
-
-  return i;
-}
 
-// Handle a keyboard event. Return 0 on success, -1 on error.
-int handleEvent(int uinput_fd, struct input_event *ev) {
-  if (ev->type == EV_KEY) {
-    if (ev->code == KEY_CAPSLOCK) {
-      if (ev->value == DOWN) {
-        // Start a timer when CAPSLOCK is pressed.
-        if (gettimeofday(&capslock_press_time, NULL) < 0) {
-          warn("Error while getting the time of CAPSLOCK press");
-          return -1;
-        }
-        capslock_state = DOWN;
-      } else if (ev->value == UP) {
-        // Check how long it has been since CAPSLOCK was pressed.
-        long elapsed = timeSince(&capslock_press_time);
-        if (elapsed < 0) {
-          warn("Error while getting the time of CAPSLOCK release");
-          return -1;
-        }
-        if (capslock_state == DOWN && elapsed < timeout_ms) {
-          // If CAPSLOCK was released within the timeout, simulate ESC.
-          if (uinputWriteEvent(uinput_fd, ev, KEY_ESC, DOWN) < 0) {
-            warn("Error while sending ESC key press");
-            return -1;
-          }
-          if (uinputWriteEvent(uinput_fd, ev, KEY_ESC, UP) < 0) {
-            warn("Error while sending ESC key release");
-            return -1;
-          }
-        }
-        capslock_state = UP;
-      }
-    } else if (capslock_state == DOWN) {
-      // If we press another key while CAPSLOCK is being held down, we don't
-      // want the CAPSLOCK press to be eligible for ESC simulation.
-      capslock_state = UP;
+    // Skip keyboards removed by an earlier event in this batch.
+    Keyboard *kbd = (Keyboard *)source;
+    if (kbd->source.fd < 0) {
+      continue;
+    }
+    if (epoll_events[i].events & EPOLLIN) {
+      // Keyboards are only reported when they become readable, and are read
+      // until drained in turn.
+      queueKeyboard(kbd);
+    } else if (epoll_events[i].events & (EPOLLHUP | EPOLLERR)) {
+      // The keyboard has been unplugged.
+      removeKeyboard(epoll_fd, kbd);
     }
   }
-  return 0;
+  return running;
 }
 
 void printHelp(const char *program_name) {
-  printf("Usage: %s [-t TIMEOUT_MS] [-h]\n", program_name);
+  printf("Usage: %s [-c FILE] [-t TIMEOUT_MS] [-A MIN_MS:MAX_MS] [-P FILE]\n"
+         "       [-m MAPPING]... [-g]\n"
+         "       [-T CHORD_MS] [-k CHORD]... [-L LAYER:KEY[:TARGET]]...\n"
+         "       [-a PROPERTY=PATTERN]... [-d PROPERTY=PATTERN]... [-l]\n"
+         "       [-s POLICY[:PRIORITY]] [-C CPUS] [-i] [-S FILE] [-p FILE]\n"
+         "       [-D FILE] [-U USER] [-h] [DEVICE]...\n",
+         program_name);
   printf("Options:\n");
-  printf("  -t TIMEOUT_MS  Timeout for generating an ESC event.\n");
+  printf("  -c FILE        Read timeout and mappings from FILE, reloaded\n");
+  printf("                 whenever it changes.\n");
+  printf("  -t TIMEOUT_MS  Timeout for generating a tap key event.\n");
+  printf("  -A MIN_MS:MAX_MS\n");
+  printf("                 Adapt the timeout within these bounds to how\n");
+  printf("                 long dual-role keys are held when pressed alone,\n");
+  printf("                 for each seat.\n");
+  printf("  -P FILE        Keep what the adaptive timeout learned in FILE,\n");
+  printf("                 across restarts.\n");
+  printf("  -m MAPPING     KEY:TAP[:HOLD[:POLICY[:QUICK_TAP_MS]]]\n");
+  printf("                 Send TAP when KEY is pressed alone, and make KEY\n");
+  printf("                 act as HOLD when grabbing. Can be repeated.\n");
+  printf("                 POLICY is hold-on-other-key-press (default),\n");
+  printf("                 permissive-hold or tap-preferred. Pressing KEY\n");
+  printf("                 within QUICK_TAP_MS of a tap repeats TAP.\n");
+  printf("                 HOLD can be @LAYER to activate a layer.\n");
+  printf("                 Default: capslock:esc:leftctrl.\n");
+  printf("  -g             Grab the keyboards and remap dual-role keys.\n");
+  printf("  -T CHORD_MS    Time to press all the keys of a chord. Default:\n");
+  printf("                 %d.\n", default_config.chord_ms);
+  printf("  -k CHORD       KEY+KEY[+KEY...]:OUTPUT\n");
+  printf("                 Send OUTPUT when the KEYs are pressed together,\n");
+  printf("                 when grabbing. Can be repeated.\n");
+  printf("  -L LAYER:KEY[:TARGET]\n");
+  printf("                 Make KEY send TARGET on LAYER (1-%d, or 0 for\n",
+         MAX_LAYERS - 1);
+  printf("                 the base layer), or copy the nav or numpad\n");
+  printf("                 layout if KEY is one of them. Repeatable.\n");
+  printf("  -a PROPERTY=PATTERN\n");
+  printf("                 Only monitor keyboards whose udev PROPERTY, or\n");
+  printf("                 NAME, matches the shell PATTERN. Repeatable.\n");
+  printf("  -d PROPERTY=PATTERN\n");
+  printf("                 Ignore such keyboards. Repeatable.\n");
+  printf("  -l             Measure latencies, printed on SIGUSR1 and exit.\n");
+  printf("  -s POLICY[:PRIORITY]\n");
+  printf("                 Use the fifo or rr realtime scheduler and lock\n");
+  printf("                 the daemon in memory. Default priority: %d.\n",
+         DEFAULT_REALTIME_PRIORITY);
+  printf("  -C CPUS        Pin the event loop to CPUS, like 2 or 0-3,8, or\n");
+  printf("                 to those servicing the keyboard interrupts with\n");
+  printf("                 irq.\n");
+  printf("  -i             Use io_uring to read the keyboards and write to\n");
+  printf("                 uinput, if supported (Linux 6.7+).\n");
+  printf("  -S FILE        Publish counters in the shared memory FILE, on a\n");
+  printf("                 tmpfs like /dev/shm.\n");
+  printf("  -p FILE        Print the counters published in FILE and exit.\n");
+  printf("  -D FILE        Dump the last events to the trace FILE on\n");
+  printf("                 SIGUSR2, for wlcape-bench -f.\n");
+  printf("  -U USER        Run the event loop as USER under a seccomp\n");
+  printf("                 filter, with the keyboards found through udev\n");
+  printf("                 and the files opened by a privileged helper\n");
+  printf("                 process.\n");
   printf("  -h             Display this help message.\n");
+  printf("Monitors the given keyboard devices, or all of them by default.\n");
 }
 
 int main(int argc, char *argv[]) {
   // Option parsing.
   int opt;
-  while ((opt = getopt(argc, argv, "ht:")) != -1) {
+  int realtime = 0;
+  int sched_policy;
+  int sched_priority;
+  int use_uring = 0;
+  int pin = 0;
+  const char *config_file = NULL;
+  const char *stats_file = NULL;
+  const char *adaptive_file = NULL;
+  const char *user = NULL;
+  while ((opt = getopt(argc, argv, "A:C:D:L:P:S:T:U:a:c:d:ghik:lm:p:s:t:")) !=
+         -1) {
     switch (opt) {
+      case 'a':
+      case 'd':
+        if (addDeviceMatch(optarg, opt == 'd') < 0) {
+          fprintf(stderr, "Invalid device match: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'S':
+        stats_file = optarg;
+        break;
+      case 'D':
+        trace_path = optarg;
+        break;
+      case 'p':
+        return printStatsFile(optarg) < 0;
+      case 'c':
+        config_file = optarg;
+        break;
       case 't':
-        timeout_ms = atoi(optarg);
+        default_config.timeout_ms = atoi(optarg);
+        break;
+      case 'A':
+        if (parseAdaptiveBounds(&default_config, optarg) < 0) {
+          fprintf(stderr, "Invalid adaptive timeout bounds: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'C':
+        if (parseAffinity(optarg) < 0) {
+          fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+          return 1;
+        }
+        pin = 1;
+        break;
+      case 'P':
+        adaptive_file = optarg;
+        break;
+      case 'U':
+        user = optarg;
+        break;
+      case 'm':
+        if (addDualRoleKey(&default_config, optarg) < 0) {
+          fprintf(stderr, "Invalid mapping: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'T':
+        default_config.chord_ms = atoi(optarg);
+        break;
+      case 'k':
+        if (addChord(&default_config, optarg) < 0) {
+          fprintf(stderr, "Invalid chord: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'L':
+        if (addLayerKey(&default_config, optarg) < 0) {
+          fprintf(stderr, "Invalid layer key: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'g':
+        grab = 1;
+        break;
+      case 'i':
+        use_uring = 1;
+        break;
+      case 'l':
+        measure_latency = 1;
+        break;
+      case 's':
+        if (parseScheduler(optarg, &sched_policy, &sched_priority) < 0) {
+          fprintf(stderr, "Invalid scheduling policy: %s\n", optarg);
+          return 1;
+        }
+        realtime = 1;
         break;
       case 'h':
         printHelp(argv[0]);
@@ -225,90 +293,179 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  // Open keyboard fds.
-  int kbd_fds[MAX_KEYBOARDS];
-  int n_keyboards = getKeyboardsFds((int *)&kbd_fds);
-
-  // Setup uinput device.
-  int uinput_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-  if (uinput_fd < 0) {
-    die("Error opening uinput");
+  // By default, CAPSLOCK acts as ESC when tapped and as Ctrl otherwise.
+  if (default_config.n_dual_role_keys == 0) {
+    addDualRoleKey(&default_config, "capslock:esc:leftctrl");
   }
 
-  // We are going to be generating EV_KEY events.
-  if (ioctl(uinput_fd, UI_SET_EVBIT, EV_KEY) < 0) {
-    die("Error setting EV_KEY on uinput's EVBIT");
-  }
-  // We are going to support CAPSLOCK and ESC.
-  if (ioctl(uinput_fd, UI_SET_KEYBIT, KEY_CAPSLOCK) < 0) {
-    die("Error setting KEY_CAPSLOCK on uinput's KEYBIT");
-  }
-  if (ioctl(uinput_fd, UI_SET_KEYBIT, KEY_ESC) < 0) {
-    die("Error setting KEY_ESC on uinput's KEYBIT");
+  // The configuration file overrides the command line.
+  if (config_file != NULL) {
+    Config *c = malloc(sizeof(Config));
+    if (c == NULL) {
+      die("Error allocating configuration");
+    }
+    if (loadConfig(config_file, c) < 0) {
+      return 1;
+    }
+    replaceConfig(c);
   }
 
-  // Define a virtual keyboard device.
-  struct uinput_setup usetup;
-  memset(&usetup, 0, sizeof(usetup));
-  usetup.id.bustype = BUS_USB;
-  usetup.id.vendor = 0x0001;
-  usetup.id.product = 0x0001;
-  strcpy(usetup.name, "wlcape");
-
-  // Setup and create uinput virtual keyboard device.
-  if (ioctl(uinput_fd, UI_DEV_SETUP, &usetup) < 0) {
-    die("Error setting up uinput device");
+  // Publish the counters before anything is counted.
+  if (stats_file != NULL && publishStats(stats_file) < 0) {
+    die("Error publishing statistics");
   }
-  if (ioctl(uinput_fd, UI_DEV_CREATE) < 0) {
-    die("Error creating uinput device");
+  // Pick up where the adaptive timeout left off.
+  if (adaptive_file != NULL && mapAdaptiveState(adaptive_file) < 0) {
+    die("Error mapping adaptive timeout state");
   }
+  reportTimeout();
 
   // Create the epoll instance.
   int epoll_fd = epoll_create1(0);
   if (epoll_fd < 0) {
     die("Error creating epoll instance");
   }
-  // Add each keyboard fd to the epoll instance.
-  for (int i = 0; i < n_keyboards; i++) {
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = kbd_fds[i];
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, kbd_fds[i], &ev) < 0) {
-      die("Error adding keyboard fd to epoll instance");
+
+  // Keyboards are read with io_uring if possible, falling back to epoll on
+  // older kernels.
+  if (use_uring && uringSetup(epoll_fd) < 0) {
+    warn("io_uring is not supported, using epoll instead");
+  }
+
+  // Setup the virtual keyboard of the default seat, watched for LED events
+  // when grabbing and for room to write when it falls behind. Those of the
+  // other seats are created along with their first keyboard.
+  if (addSeat(epoll_fd, DEFAULT_SEAT, -1) == NULL) {
+    die("Error adding uinput fd to epoll instance");
+  }
+
+  // When grabbing, the hold keys are pressed by a timer.
+  if (grab) {
+    timer_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer_source.fd < 0) {
+      die("Error creating hold timer");
+    }
+    if (addSource(epoll_fd, &timer_source, EPOLLIN) < 0) {
+      die("Error adding hold timer fd to epoll instance");
+    }
+  }
+
+  // Handle termination, statistics and trace signals from the event loop.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0) {
+    die("Error blocking signals");
+  }
+  Source signal_source;
+  signal_source.type = SOURCE_SIGNAL;
+  signal_source.fd = signalfd(-1, &signals, SFD_NONBLOCK);
+  if (signal_source.fd < 0) {
+    die("Error creating signalfd");
+  }
+  if (addSource(epoll_fd, &signal_source, EPOLLIN) < 0) {
+    die("Error adding signalfd to epoll instance");
+  }
+
+  // Reload the configuration file when it changes.
+  if (config_file != NULL && addConfigWatch(epoll_fd, config_file) < 0) {
+    die("Error watching configuration file");
+  }
+
+  // Keyboards given on the command line or passed by systemd are used as they
+  // are, skipping udev altogether.
+  struct udev *udev = NULL;
+  struct udev_monitor *monitor = NULL;
+  Source monitor_source;
+  int n_listened = addListenedKeyboards(epoll_fd);
+  for (int i = optind; i < argc; i++) {
+    if (addKeyboardPath(epoll_fd, argv[i]) < 0) {
+      fprintf(stderr, "Error adding keyboard: %s\n", argv[i]);
     }
   }
+  int use_udev = n_listened == 0 && optind == argc;
+  if (user != NULL &&
+      (use_udev || config_file != NULL || trace_path != NULL)) {
+    // The event loop cannot open the keyboards nor the files once
+    // unprivileged.
+    startHelper(epoll_fd, use_udev);
+  } else if (use_udev) {
+    // Get udev context.
+    udev = udev_new();
+    if (udev == NULL) {
+      die("Error creating udev context");
+    }
+    // Start listening for hotplug events before enumerating the keyboards, so
+    // that none can be missed in between.
+    monitor = addMonitor(udev, epoll_fd, &monitor_source);
+    addKeyboards(udev, epoll_fd);
+  }
 
-  // Event processing loop.
-  struct input_event ev;
-  struct epoll_event epoll_events[MAX_KEYBOARDS];
+  // Keep the event loop on the CPUs handling the keyboard events, then make
+  // sure, now that all the buffers are allocated, that it is never delayed by
+  // other processes or page faults.
+  if (pin) {
+    pinEventLoop();
+  }
+  if (realtime) {
+    enableRealtime(sched_policy, sched_priority);
+  }
 
-  while (1) {
-    // Wait for events on the epoll instance.
-    int n_events = epoll_wait(epoll_fd, epoll_events, n_keyboards, -1);
-    if (n_events < 0) {
-      die("Error waiting for events on epoll instance");
+  // Then give up the privileges it no longer needs, for good.
+  if (user != NULL) {
+    if (dropPrivileges(user) < 0) {
+      die("Error dropping privileges");
+    }
+    if (installSeccomp() < 0) {
+      die("Error installing seccomp filter");
     }
+  }
 
-    // Process epoll events.
-    for (int i = 0; i < n_events; i++) {
-      if (epoll_events[i].events & EPOLLIN) {
-        // Read an event from one of the keyboards.
-        int kbd_fd = epoll_events[i].data.fd;
-        if (read(kbd_fd, &ev, sizeof(ev)) < 0) {
-          warn("Error reading event from keyboard device");
-          continue;
-        }
-        // Handle the keyboard event.
-        handleEvent(uinput_fd, &ev);
+  // Event processing loop.
+  int running = 1;
+  int keyboards_ready = 0;
+  while (running) {
+    if (uring_fd >= 0) {
+      // Handle keyboard events and uinput writes with io_uring, and the other
+      // sources when the epoll instance has events ready.
+      if (uringWait()) {
+        running = handleSources(epoll_fd, monitor, 0);
       }
+    } else {
+      // Don't wait while a keyboard still has events to read.
+      running = handleSources(epoll_fd, monitor, keyboards_ready ? 0 : -1);
+      keyboards_ready = readReadyKeyboards(epoll_fd);
     }
+    freeClosedKeyboards();
+  }
+
+  if (measure_latency) {
+    dumpLatencies();
   }
 
-  // Close all open file descriptors.
-  close(uinput_fd);
-  for (int i = 0; i < n_keyboards; i++) {
-    close(kbd_fds[i]);
+  // Close all open file descriptors and release udev resources.
+  while (n_keyboards > 0) {
+    removeKeyboard(epoll_fd, keyboards[0]);
+  }
+  uringClose();
+  freeClosedKeyboards();
+  free(keyboards);
+  if (monitor != NULL) {
+    udev_monitor_unref(monitor);
+    udev_unref(udev);
+  }
+  if (timer_source.fd >= 0) {
+    close(timer_source.fd);
+  }
+  if (config_source.fd >= 0) {
+    close(config_source.fd);
   }
+  close(signal_source.fd);
+  removeSeats();
+  close(epoll_fd);
 
   return 0;
 }
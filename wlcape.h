@@ -0,0 +1,537 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WLCAPE_H_
+#define WLCAPE_H_
+
+#include <linux/input.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+struct udev;
+struct udev_device;
+struct udev_enumerate;
+struct udev_monitor;
+
+// Maximum number of epoll events handled per epoll_wait() call. Any event left
+// over is reported again by the next call.
+#define MAX_EPOLL_EVENTS 32
+
+// Maximum number of events read from a keyboard with a single read() call.
+// A keypress frame is at most 3 events (EV_MSC, EV_KEY, EV_SYN), so this is
+// enough to drain several frames per wakeup.
+#define MAX_EVENTS_PER_READ 64
+
+// Maximum number of reads from a keyboard before the others get their turn.
+#define KEYBOARD_READ_BUDGET 4
+
+// Maximum number of events queued for a single write to uinput. A tap needs a
+// press and a release in the input and produces 4 events, so this usually holds
+// the output for a full read buffer. It is flushed early otherwise.
+#define MAX_OUTPUT_EVENTS (MAX_EVENTS_PER_READ * 2)
+
+// Size of the io_uring submission queue, number of buffers provided for
+// keyboard reads (a power of two), and number of writes to uinput that can be
+// in flight (at most 32).
+#define URING_ENTRIES 256
+#define URING_READ_BUFFERS 64
+#define URING_WRITE_BUFFERS 32
+
+// Maximum number of allow and of deny rules for devices.
+#define MAX_DEVICE_MATCHES 32
+
+// First file descriptor passed by systemd socket activation.
+#define LISTEN_FDS_START 3
+
+// Maximum number of events waiting for uinput to be writable again.
+#define MAX_BACKLOG_EVENTS 4096
+
+// Seat of the keyboards udev assigns to none, and start of the physical path
+// of the virtual keyboards, followed by their seat.
+#define DEFAULT_SEAT "seat0"
+#define UINPUT_PHYS_PREFIX "wlcape/"
+
+// Maximum number of dual-role keys, which must fit in a 32-bit mask.
+#define MAX_DUAL_ROLE_KEYS 32
+
+// Maximum number of events of a keyboard held back while one of its dual-role
+// keys is undecided. The key is resolved as a hold once they fill up.
+#define MAX_HELD_BACK_EVENTS 32
+
+// Maximum number of chords, which must fit in a 32-bit mask, of keys making up
+// a chord, and of events of a keyboard held back while a chord may be pressed.
+#define MAX_CHORDS 32
+#define MAX_CHORD_KEYS 4
+#define MAX_CHORD_EVENTS 16
+
+// Number of layers, including the base one, which must fit in a 32-bit mask.
+#define MAX_LAYERS 8
+
+// The adaptive tap timeout settles on this percentile of the durations of the
+// dual-role keys pressed alone, moving by steps of this many microseconds. It
+// is learned for each seat, and kept in the state file for this many seats.
+#define ADAPTIVE_QUANTILE 95
+#define ADAPTIVE_STEP_US 2000
+#define MAX_ADAPTIVE_SEATS 64
+
+// Latencies are recorded in a log-linear histogram: values are bucketed by
+// their power of two, and each power of two is split into this many linear
+// sub-buckets (as a power of two), up to a maximum power of two.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Default priority of the realtime scheduling policies, and amount of stack
+// faulted in ahead of time when running with one.
+#define DEFAULT_REALTIME_PRIORITY 10
+#define PREFAULT_STACK_SIZE (256 * 1024)
+
+// Number of bits in a long, and number of longs needed to store n bits.
+#define LONG_BITS (sizeof(unsigned long) * 8)
+#define N_LONGS(n) (((n) + LONG_BITS - 1) / LONG_BITS)
+
+// State of a key.
+typedef enum {
+  UP = 0,
+  DOWN = 1,
+} PressedState;
+
+// How a dual-role key is resolved when grabbing, if other keys are pressed
+// before it is released. It is a hold anyway once the timeout expires.
+typedef enum {
+  POLICY_HOLD_ON_OTHER_KEY_PRESS,  // Hold as soon as another key is pressed.
+  POLICY_PERMISSIVE_HOLD,          // Hold if another key is tapped meanwhile.
+  POLICY_TAP_PREFERRED,            // Tap whenever released within the timeout.
+} DualRolePolicy;
+
+// A key acting as another key when tapped, and as yet another when held.
+typedef struct {
+  uint16_t key;           // Physical key.
+  uint16_t tap;           // Key sent when the key is tapped.
+  uint16_t hold;          // Key the physical key is remapped to when grabbing.
+  uint16_t policy;        // DualRolePolicy.
+  uint16_t layer;         // Layer activated instead when held, or 0.
+  uint32_t quick_tap_ms;  // Pressing the key again within it sends its tap.
+} DualRoleKey;
+
+// Keys sending another key when pressed together.
+typedef struct {
+  uint16_t keys[MAX_CHORD_KEYS];
+  uint16_t n_keys;
+  uint16_t output;  // Key sent instead.
+} Chord;
+
+// Tunables, dual-role keys, chords and layers. The tap timeout adapts within
+// the adaptive bounds, unless they are 0. The keys are indexed by their
+// slot in that table plus one, indexed by key code, or 0 for the other keys.
+// The chords are matched with masks of their slots: those including each key
+// code, and those made of each number of keys. Each layer has the key sent for
+// each key code, or 0 to send the key itself.
+typedef struct {
+  int timeout_ms;  // If a dual-role key is released within it, send its tap.
+  int chord_ms;    // The keys of a chord must all be pressed within it.
+  int adaptive_min_ms;
+  int adaptive_max_ms;
+  int n_dual_role_keys;
+  DualRoleKey dual_role_keys[MAX_DUAL_ROLE_KEYS];
+  uint8_t dual_role_slots[KEY_CNT];
+  int n_chords;
+  Chord chords[MAX_CHORDS];
+  uint32_t chord_masks[KEY_CNT];
+  uint32_t chord_sizes[MAX_CHORD_KEYS + 1];
+  uint16_t layers[MAX_LAYERS][KEY_CNT];
+} Config;
+
+// Log-linear histogram of latencies.
+typedef struct {
+  const char *name;
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+// Stages of the event pipeline that latencies are measured for.
+typedef enum {
+  STAGE_WAKE,    // From the kernel timestamp to epoll_wait() returning.
+  STAGE_READ,    // From epoll_wait() returning to the events being read.
+  STAGE_HANDLE,  // From the events being read to them being handled.
+  STAGE_FLUSH,   // From the events being handled to uinput being written.
+  STAGE_TOTAL,   // From the kernel timestamp to uinput being written.
+  STAGE_INJECT,  // From the source event of each output event to its write.
+  N_STAGES,
+} Stage;
+
+// A rule matching devices whose udev property matches a shell pattern.
+typedef struct {
+  char property[64];
+  const char *pattern;
+} DeviceMatch;
+
+// Kinds of file descriptors watched by the epoll instance.
+typedef enum {
+  SOURCE_KEYBOARD,
+  SOURCE_MONITOR,
+  SOURCE_UINPUT,
+  SOURCE_TIMER,
+  SOURCE_SIGNAL,
+  SOURCE_CONFIG,
+  SOURCE_HELPER,
+} SourceType;
+
+// Common header of everything watched by the epoll instance, which is what
+// the data.ptr field of epoll events points to.
+typedef struct {
+  SourceType type;
+  int fd;  // Watched file descriptor, or -1 once closed.
+} Source;
+
+// Magic number and version at the start of the adaptive timeout state file.
+#define ADAPTIVE_MAGIC "WLCA"
+#define ADAPTIVE_VERSION 2
+
+// Estimate of the quantile of the durations of the dual-role keys of a seat
+// pressed alone, as laid out in the adaptive timeout state file.
+typedef struct {
+  char seat[32];     // udev ID_SEAT, empty for a free entry of the file.
+  int64_t estimate_us;
+  uint64_t samples;  // Presses learned from.
+} AdaptiveState;
+
+// Layout of the adaptive timeout state file, with an estimate for each seat.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  AdaptiveState seats[MAX_ADAPTIVE_SEATS];
+} AdaptiveFile;
+
+// State of the dual-role keys of a keyboard: masks of the slots of the keys
+// pressed without any other key event since, which are still eligible for a
+// tap, of those whose hold key has been pressed, of those whose tap key has
+// been pressed by a quick tap, and of the pending ones the hold timer has been
+// armed for, and of the keys down while no other key has been pressed, which
+// the adaptive timeout learns from. Kernel time of the last press and of the
+// last tap of each key.
+// When grabbing, at most one key is pending, and the events following it are
+// held back until it is resolved if its policy requires so. Mask of the layers
+// activated by held keys, and key sent for each key pressed on them, or 0.
+// Bitmap of the other keys whose press has been forwarded while grabbing, and
+// not their release yet, by key code. Tap timeout learned for the seat of the
+// keyboard.
+typedef struct {
+  uint32_t pending;
+  uint32_t held;
+  uint32_t tapping;
+  uint32_t timer_pending;
+  uint32_t solo;
+  uint32_t layers;
+  uint16_t layer_keys[KEY_CNT];
+  uint64_t forwarded[(KEY_CNT + 63) / 64];
+  struct timeval press_times[MAX_DUAL_ROLE_KEYS];
+  struct timeval tap_times[MAX_DUAL_ROLE_KEYS];
+  size_t n_held_back;
+  struct input_event held_back[MAX_HELD_BACK_EVENTS];
+  AdaptiveState *adaptive;
+} DualRoleState;
+
+// State of the chords of a keyboard: mask of the slots of the chords including
+// all the keys pressed since the first one, which are held back meanwhile,
+// number of those keys, and kernel time of the first. Mask of the chords that
+// have been pressed, of those whose output key is still down, and for each
+// chord, mask of its keys still down. Whether the hold timer has been armed for
+// the chord being pressed.
+typedef struct {
+  uint32_t candidates;
+  int n_keys;
+  struct timeval start;
+  uint32_t active;
+  uint32_t output_down;
+  uint8_t keys_down[MAX_CHORDS];
+  int timer_armed;
+  size_t n_held_back;
+  struct input_event held_back[MAX_CHORD_EVENTS];
+} ChordState;
+
+// A seat, with the uinput virtual keyboard the events of its keyboards are
+// sent to, its tap timeout, either in the state file or in the seat itself,
+// and the events it could not take yet or that wait behind the writes of
+// io_uring in flight, the first ones being those of failed writes.
+typedef struct Seat {
+  Source source;     // Virtual keyboard, must be the first field.
+  char name[32];     // udev ID_SEAT of its keyboards.
+  uint32_t watched;  // Epoll events the virtual keyboard is watched for.
+  int frame_open;    // Whether events were queued since the last SYN_REPORT.
+  AdaptiveState *adaptive;
+  AdaptiveState local_adaptive;
+  size_t n_failed;
+  size_t n_backlog;
+  struct input_event backlog[MAX_BACKLOG_EVENTS];
+} Seat;
+
+// Kinds of messages between the event loop and the privileged helper.
+typedef enum {
+  HELPER_KEYBOARD,  // Keyboard passed to the event loop.
+  HELPER_CONFIG,    // Configuration file, asked for by the event loop.
+  HELPER_TRACE,     // Trace file to write, asked for by the event loop.
+} HelperKind;
+
+// Keyboard passed by the privileged helper to the event loop, along with its
+// fd and, for a seat other than the default one, an fd of /dev/uinput to
+// create the virtual keyboard of the seat with. Or file asked for by the event
+// loop, which it cannot open once unprivileged, passed back along with its fd
+// unless opening it failed.
+typedef struct {
+  HelperKind kind;
+  int error;  // errno of opening the file, or 0.
+  dev_t devnum;
+  char seat[32];
+} HelperMessage;
+
+// An open keyboard device. Allocated on the cache line boundary, with the
+// fields used when reading events first.
+typedef struct Keyboard {
+  Source source;                 // Must be the first field.
+  size_t index;                  // Position in the keyboards table.
+  dev_t devnum;                  // Device number, to match udev events.
+  struct Keyboard *next_closed;  // Next keyboard waiting to be freed.
+  struct Keyboard *next_ready;   // Next keyboard with events left to read.
+  int ready;                     // Whether it is queued to be read.
+  int reading;                   // Whether a read is posted to io_uring.
+  Seat *seat;                    // Seat the keyboard belongs to.
+  ChordState chord;              // State of the chords.
+  DualRoleState dual_role;       // State of the dual-role keys.
+  struct input_event events[MAX_EVENTS_PER_READ];  // Read buffer.
+} Keyboard;
+
+// Magic number and version at the start of the shared memory statistics file.
+#define STATS_MAGIC "WLCS"
+#define STATS_VERSION 1
+
+// Counters of the event loop, as laid out in the shared memory statistics
+// file. Fields are only ever added at the end.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t events;         // Input events handled.
+  uint64_t taps;           // Tap keys sent.
+  uint64_t holds;          // Hold keys pressed.
+  uint64_t read_errors;    // Failed reads from keyboards.
+  uint64_t write_eagain;   // Writes to uinput failing with EAGAIN.
+  uint64_t write_errors;   // Writes to uinput failing otherwise.
+  uint64_t keyboards;      // Keyboards currently attached.
+  uint64_t write_dropped;  // Batches whose key presses were dropped.
+  uint64_t timeout_us;     // Tap timeout of the seat learned from last.
+  uint64_t wakeups;        // Returns from waiting for the sources.
+  uint64_t timer_wakeups;  // Expirations of the hold timer handled.
+  uint64_t presses;        // Key presses handled.
+} Stats;
+
+// Magic number and version at the start of trace files, which are replayed by
+// the benchmark.
+#define TRACE_MAGIC "WLCT"
+#define TRACE_VERSION 3
+
+// Number of the last events kept in the trace ring, a power of two.
+#define TRACE_RING_SIZE 4096
+
+// Kinds of trace records, in the low byte of their flags.
+typedef enum {
+  TRACE_INPUT,     // Event read from a keyboard, replayed by the benchmark.
+  TRACE_OUTPUT,    // Event written to uinput.
+  TRACE_DECISION,  // Decision taken on the input events, without output.
+} TraceKind;
+
+// Decisions leading to output events, in the high byte of the flags of their
+// trace records.
+typedef enum {
+  DECISION_FORWARD,    // Forwarded as it is.
+  DECISION_LAYER,      // Remapped by a layer.
+  DECISION_TAP,        // Tap key of a dual-role key.
+  DECISION_HOLD,       // Hold key of a dual-role key.
+  DECISION_QUICK_TAP,  // Tap key of a dual-role key pressed again.
+  DECISION_CHORD,      // Output key of a chord, pressed for the keys held back.
+  DECISION_RESET,      // Key released as its keyboard was removed.
+} Decision;
+#define TRACE_FLAGS(kind, decision) ((kind) | (decision) << 8)
+
+// Header of a trace file, followed by any number of TraceRecords.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+} TraceHeader;
+
+// An event in a trace file. Output events keep the time of the input event
+// they come from, as uinput stamps the events it injects itself, and when
+// measuring latencies, how long after it they were written: the time of their
+// injection is the sum of both.
+typedef struct {
+  struct input_event ev;
+  uint16_t device;    // Index of the keyboard the event comes from.
+  uint16_t flags;     // TraceKind, and Decision of output events. 0 in v1.
+  uint32_t delay_us;  // From the source event to the write. 0 before v3.
+} TraceRecord;
+
+// adaptive.c
+long tapTimeoutUs(const AdaptiveState *adaptive);
+void reportTimeout(void);
+void adaptTimeout(AdaptiveState *adaptive, long duration_us);
+int mapAdaptiveState(const char *path);
+void bindAdaptiveState(Seat *seat);
+int parseAdaptiveBounds(Config *c, const char *bounds);
+
+// affinity.c
+int parseAffinity(const char *spec);
+void pinEventLoop(void);
+
+// histogram.c
+extern int measure_latency;
+extern Histogram latencies[N_STAGES];
+extern uint64_t wake_time_us;
+void histogramRecord(Histogram *h, int64_t value);
+uint64_t histogramQuantile(const Histogram *h, double quantile);
+void printHistogram(const Histogram *h, const char *unit);
+void dumpLatencies(void);
+
+// keyboard.c
+extern Keyboard **keyboards;
+extern size_t n_keyboards;
+void handleUinputEvents(Seat *seat);
+Keyboard *findKeyboard(dev_t devnum);
+int addDeviceMatch(const char *rule, int deny);
+int addKeyboardFd(int epoll_fd, int fd, dev_t devnum, Seat *seat);
+int isMonitoredKeyboard(struct udev_device *device);
+int addKeyboard(int epoll_fd, struct udev_device *device);
+int addKeyboardPath(int epoll_fd, const char *path);
+int addListenedKeyboards(int epoll_fd);
+void removeKeyboard(int epoll_fd, Keyboard *kbd);
+void queueKeyboard(Keyboard *kbd);
+int readReadyKeyboards(int epoll_fd);
+void freeClosedKeyboards(void);
+struct udev_enumerate *enumerateKeyboards(struct udev *udev);
+void addKeyboards(struct udev *udev, int epoll_fd);
+struct udev_monitor *addMonitor(struct udev *udev, int epoll_fd,
+                                Source *source);
+void handleMonitorEvent(int epoll_fd, struct udev_monitor *monitor);
+
+// chord.c
+uint64_t chordDeadline(const ChordState *chord);
+int expireChord(Keyboard *kbd, const struct input_event *ev);
+void resetChordState(Keyboard *kbd);
+int handleChordEvent(Keyboard *kbd, struct input_event *ev);
+int addChord(Config *c, const char *mapping);
+
+// config.c
+extern Source config_source;
+extern const char *config_path;
+int loadConfigFd(int fd, const char *path, Config *c);
+int loadConfig(const char *path, Config *c);
+int addConfigWatch(int epoll_fd, const char *path);
+void reloadConfig(int fd);
+void handleConfigEvents(void);
+
+// layer.c
+int layerKey(DualRoleState *state, const struct input_event *ev);
+int parseLayer(const char *name, int allow_base);
+int addLayerKey(Config *c, const char *mapping);
+
+// remap.c
+extern Config default_config;
+extern const Config *config;
+extern int grab;
+extern Source timer_source;
+void handleTimer(void);
+void resetDualRoleState(DualRoleState *state);
+int handleEvent(DualRoleState *state, struct input_event *ev);
+int handleEvents(Keyboard *kbd, struct input_event *events, size_t n_events);
+int parseKey(const char *name);
+int addDualRoleKey(Config *c, const char *mapping);
+void replaceConfig(Config *c);
+void applyConfig(void);
+
+// sandbox.c
+extern int event_loop_fd;
+extern int files_from_helper;
+int sendKeyboard(int fd, dev_t devnum, const char *seat);
+void startHelper(int epoll_fd, int monitor_keyboards);
+int requestHelperFile(HelperKind kind);
+void handleHelperMessage(int epoll_fd);
+int dropPrivileges(const char *user);
+int installSeccomp(void);
+
+// stats.c
+extern Stats *stats;
+int publishStats(const char *path);
+void printStats(const Stats *s);
+const Stats *mapStatsFile(const char *path);
+int printStatsFile(const char *path);
+
+// trace.c
+extern int trace_device;
+extern const char *trace_path;
+void traceEvent(const struct input_event *ev, int flags);
+void traceInjection(void);
+int dumpTraceFd(int fd);
+int dumpTrace(const char *path);
+
+// uinput.c
+extern Seat **seats;
+extern size_t n_seats;
+Seat *findSeat(const char *name);
+Seat *addSeat(int epoll_fd, const char *name, int uinput_fd);
+void removeSeats(void);
+void uinputSelect(Seat *seat);
+int isKeptEvent(const struct input_event *ev, const struct input_event *prev);
+int uinputBacklogReleases(Seat *seat, size_t at,
+                          const struct input_event *events, size_t n_events);
+int uinputBacklog(Seat *seat, size_t at, const struct input_event *events,
+                  size_t n_events);
+int uinputDefer(Seat *seat, const struct input_event *events, size_t n_events);
+int uinputRetry(Seat *seat, const struct input_event *events, size_t n_events);
+void uinputConsume(Seat *seat, size_t n_events);
+void uinputDrain(Seat *seat);
+void countWriteError(int error);
+int uinputFlush(void);
+int uinputQueue(const struct input_event *ev, int decision);
+int uinputQueueSync(void);
+int uinputQueueEvent(const struct input_event *base_ev, int code, int value,
+                     int decision);
+int uinputQueueTap(const struct input_event *base_ev, int code, int decision);
+int openUinput(void);
+int createUinput(Seat *seat, int fd);
+
+// uring.c
+extern int uring_fd;
+int uringSetup(int epoll_fd);
+void uringClose(void);
+void uringReadKeyboard(Keyboard *kbd);
+void uringCancelRead(Keyboard *kbd);
+int uringWrite(Seat *seat, const struct input_event *events, size_t n_bytes);
+void uringDrain(Seat *seat);
+int uringWait(void);
+
+// util.c
+void die(const char *msg);
+void warn(const char *msg);
+int addSource(int epoll_fd, Source *source, uint32_t events);
+long timeBetween(const struct timeval *start, const struct timeval *end);
+uint64_t nowUs(void);
+uint64_t timevalUs(const struct timeval *t);
+int parseScheduler(const char *spec, int *policy, int *priority);
+void enableRealtime(int policy, int priority);
+
+#endif  // WLCAPE_H_